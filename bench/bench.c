@@ -0,0 +1,214 @@
+/*
+ * Mirix 1.0/bench/bench.c
+ * (C) 2022 Miris Lee
+ */
+
+/*
+ * I/O and paging benchmarks, run by /etc/rc of the benchmark image with
+ * its output on the serial port. every result is one line:
+ *
+ *	BENCH <test> key=value ...
+ *
+ * times are in ticks of 'hz', those of iostat in microseconds, the run
+ * ends with "BENCH end". the disk tests go through the buffer cache on
+ * the scratch disk, the whole of hda (0x300), which bench/Makefile makes
+ * with a fixed size. the root is on hdb, see ROOTDEV in
+ * boot/bootsect.asm.
+ */
+
+#define __LIBRARY__
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/times.h>
+#include <sys/wait.h>
+
+#include "../kernel/blk_dev/blk.h"
+
+#define HZ			100
+#define BLOCK_SIZE	1024
+
+#define SCRATCH_MAJOR	3		/* hd */
+#define SCRATCH_DEV	(SCRATCH_MAJOR << 8)	/* hda, the whole disk */
+#define SCRATCH		"/dev/bench"
+#define SCRATCH_BLOCKS	16384		/* 16MB, bench/Makefile */
+#define SEQ_BLOCKS	8192		/* twice the 4MB buffer cache of a 16MB machine */
+#define RAND_BLOCKS	1024
+#define NR_FORK		64
+#define NR_SYNC		16
+#define SYNC_BLOCKS	64
+
+#define __NR_iostat	75		/* kernel/syscall.asm */
+_syscall2(int, iostat, int, major, struct blk_stat *, buf)
+
+static char buf[BLOCK_SIZE];
+static struct blk_stat before;
+
+/* 2MB of data, touched so that fork() has it all to share */
+#define BIG_DATA	(2 * 1024 * 1024)
+static char big[BIG_DATA];
+
+static long ticks(void) {
+	struct tms t;
+
+	return times(&t);
+}
+
+/* a fixed sequence, so that every run reads the same blocks */
+static unsigned long seed = 1;
+
+static int next_block(void) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % SCRATCH_BLOCKS;
+}
+
+static void stat_start(void) {
+	iostat(SCRATCH_MAJOR, &before);
+}
+
+/* the requests the test made, per read and write */
+static void stat_end(char *test) {
+	struct blk_stat s;
+	int rw;
+
+	if (iostat(SCRATCH_MAJOR, &s) < 0) return;
+	for (rw = 0; rw < 2; ++rw) {
+		if (s.nr_req[rw] == before.nr_req[rw]) continue;
+		printf("BENCH %s-iostat rw=%s req=%lu merge=%lu sect=%lu wait_us=%lu serv_us=%lu\n",
+			test, rw? "write": "read",
+			s.nr_req[rw] - before.nr_req[rw],
+			s.nr_merge[rw] - before.nr_merge[rw],
+			s.nr_sect[rw] - before.nr_sect[rw],
+			s.wait_time[rw] - before.wait_time[rw],
+			s.serv_time[rw] - before.serv_time[rw]);
+	}
+}
+
+static void result(char *test, long t, long ops, long bytes) {
+	printf("BENCH %s ticks=%ld ops=%ld bytes=%ld hz=%d\n", test, t, ops, bytes, HZ);
+}
+
+static void seq(int fd, int wr) {
+	char *test = wr? "seq-write": "seq-read";
+	long t;
+	int i;
+
+	sync();
+	stat_start();
+	t = ticks();
+	lseek(fd, 0, SEEK_SET);
+	for (i = 0; i < SEQ_BLOCKS; ++i) {
+		if ((wr? write(fd, buf, BLOCK_SIZE): read(fd, buf, BLOCK_SIZE)) != BLOCK_SIZE) {
+			printf("BENCH %s error block=%d\n", test, i);
+			return;
+		}
+	}
+	if (wr) sync();
+	result(test, ticks() - t, SEQ_BLOCKS, (long)SEQ_BLOCKS * BLOCK_SIZE);
+	stat_end(test);
+}
+
+static void random_io(int fd, int wr) {
+	char *test = wr? "rand-write": "rand-read";
+	long t;
+	int i;
+
+	sync();
+	stat_start();
+	seed = wr? 2: 1;
+	t = ticks();
+	for (i = 0; i < RAND_BLOCKS; ++i) {
+		lseek(fd, (long)next_block() * BLOCK_SIZE, SEEK_SET);
+		if ((wr? write(fd, buf, BLOCK_SIZE): read(fd, buf, BLOCK_SIZE)) != BLOCK_SIZE) {
+			printf("BENCH %s error op=%d\n", test, i);
+			return;
+		}
+	}
+	if (wr) sync();
+	result(test, ticks() - t, RAND_BLOCKS, (long)RAND_BLOCKS * BLOCK_SIZE);
+	stat_end(test);
+}
+
+/*
+ * page-in: /bin/bigexe touches every page of its 1MB of initialised
+ * data, each one a do_no_page() read from its executable. the first run
+ * reads from the disk, the second mostly from the buffer cache.
+ */
+static void pagein(char *test) {
+	static char *argv[] = { "bigexe", NULL }, *envp[] = { NULL };
+	long t;
+	int pid, status = 0;
+
+	t = ticks();
+	if (!(pid = fork())) {
+		execve("/bin/bigexe", argv, envp);
+		_exit(127);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || status) {
+		printf("BENCH %s error status=%04x\n", test, status);
+		return;
+	}
+	result(test, ticks() - t, 1, 1024L * 1024);
+}
+
+/* fork + exit of a task with BIG_DATA of touched data */
+static void fork_exit(void) {
+	long t;
+	int i, pid, status = 0;
+
+	for (i = 0; i < BIG_DATA; i += 4096) big[i] = i;
+	t = ticks();
+	for (i = 0; i < NR_FORK; ++i) {
+		if (!(pid = fork())) _exit(0);
+		if (pid < 0) {
+			printf("BENCH fork-exit error op=%d\n", i);
+			return;
+		}
+		waitpid(pid, &status, 0);
+	}
+	result("fork-exit", ticks() - t, NR_FORK, (long)BIG_DATA);
+}
+
+/* how long sync() takes for SYNC_BLOCKS dirty blocks */
+static void sync_latency(int fd) {
+	long t, total = 0, max = 0;
+	int i, j;
+
+	sync();
+	for (i = 0; i < NR_SYNC; ++i) {
+		lseek(fd, (long)i * SYNC_BLOCKS * BLOCK_SIZE, SEEK_SET);
+		for (j = 0; j < SYNC_BLOCKS; ++j) write(fd, buf, BLOCK_SIZE);
+		t = ticks();
+		sync();
+		t = ticks() - t;
+		total += t;
+		if (t > max) max = t;
+	}
+	printf("BENCH sync ticks=%ld ops=%d max=%ld blocks=%d hz=%d\n",
+		total, NR_SYNC, max, SYNC_BLOCKS, HZ);
+}
+
+int main(void) {
+	int fd, i;
+
+	printf("BENCH start hz=%d\n", HZ);
+	for (i = 0; i < BLOCK_SIZE; ++i) buf[i] = i;
+	mknod(SCRATCH, S_IFBLK | 0600, SCRATCH_DEV);
+	if ((fd = open(SCRATCH, O_RDWR)) < 0) {
+		printf("BENCH error open=%s\n", SCRATCH);
+	} else {
+		seq(fd, 1);
+		seq(fd, 0);
+		random_io(fd, 0);
+		random_io(fd, 1);
+		sync_latency(fd);
+		close(fd);
+	}
+	sync();
+	pagein("pagein-cold");
+	pagein("pagein-warm");
+	fork_exit();
+	printf("BENCH end\n");
+	return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * Mirix 1.0/bench/bigexe.c
+ * (C) 2022 Miris Lee
+ */
+
+/*
+ * the page-in test of bench.c. 'data' is initialised, so it is in the
+ * executable and every page touched is read in by do_no_page().
+ */
+
+#define DATA_SIZE	(1024 * 1024)
+
+static char data[DATA_SIZE] = { 1 };
+
+int main(void) {
+	int i, sum = 0;
+
+	for (i = 0; i < DATA_SIZE; i += 4096) sum += data[i];
+	return sum != 1;
+}
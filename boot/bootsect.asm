@@ -10,6 +10,7 @@ SYSSEG	equ	0x1000
 ENDSYS	equ	(SYSSEG+SYSSIZE)
 
 ROOTDEV	equ	0x306		; the 1st partition of the 2nd drive
+RAMSIZE	equ	0		; RAM disk in kB, 0 -- none
 
 jmp start
 
@@ -171,7 +172,8 @@ msg1:
 	db 'Loading system ...'
 	db 13, 10, 13, 10
 	
-times 512-4-($-$$) db 0
+times 512-6-($-$$) db 0
 
+ram_size		dw RAMSIZE	; 0x901fa after the move
 root_dev		dw ROOTDEV
 boot_flag	dw 0xaa55
\ No newline at end of file
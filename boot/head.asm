@@ -129,7 +129,7 @@ filling:
 	xor eax, eax			; address of pg_dir
 	mov eax, cr3			; page directory start 
 	mov eax, cr0 
-	or eax, 0x80000000	; PG flag
+	or eax, 0x80010000	; PG flag, WP flag -- the kernel also faults on read-only pages
 	mov cr0, eax 
 	ret						; pop the address of main, and call /init/main.c 
 	
@@ -7,6 +7,13 @@
 #include <unistd.h>
 #include <time.h>
 
+#ifndef __NR_bdflush
+#define __NR_bdflush	74		/* kernel/syscall.asm */
+#endif
+#ifndef __NR_ksmd
+#define __NR_ksmd	78
+#endif
+
 /* 
  * we need to use inline fuction to protect 
  * the stack, and no function call is 
@@ -19,6 +26,8 @@ static inline _syscall0(int, fork)
 static inline _syscall0(int, pause)
 static inline _syscall1(int, setup, void *, BIOS)
 static inline _syscall0(int, sync)
+static inline _syscall0(int, bdflush)
+static inline _syscall0(int, ksmd)
 
 #include <mirix/tty.h>
 #include <mirix/sched.h>
@@ -39,7 +48,9 @@ extern void blk_dev_init(void);
 extern void chr_dev_init(void);
 extern void hd_init(void);
 extern void floppy_init(void);
+extern void virtio_blk_init(void);
 extern void mem_init(long start, long end);
+extern long rd_init(long start, long length, long end);
 extern long kernel_mktime(struct tm *tm);
 extern long startup_time;
 
@@ -47,6 +58,7 @@ extern long startup_time;
 #define EXT_MEM_K (*(unsigned short *)0x90002)
 #define DRIVE_INFO (*(struct drive_info *)0x90080)
 #define ORIG_ROOT_DEV (*(unsigned short *)0x901fc)
+#define RAMDISK_SIZE (*(unsigned short *)0x901fa)		/* kB */
 
 #define CMOS_READ(addr) ({ \
 	outb_p(0x80|addr, 0x70); \
@@ -102,6 +114,8 @@ void main (void) {
 	else 
 		buf_mem_end = 1*1024*1024;
 	main_mem_start = buf_mem_end;
+	if (RAMDISK_SIZE)
+		main_mem_start += rd_init(main_mem_start, RAMDISK_SIZE * 1024, mem_end);
 	
 	mem_init(main_mem_start, mem_end);
 	trap_init();			/* kernel/traps.c */
@@ -113,6 +127,7 @@ void main (void) {
 	buf_init(buf_mem_end);		/* fs/buffer.c */
 	hd_init();				/* kernel/blk_dev/hd.c */
 	floppy_init();			/* kernel/blk_dev/floppy.c */
+	virtio_blk_init();		/* kernel/blk_dev/virtio_blk.c */
 	sti();
 	mov_to_usr();			/* include/asm/system.h */
 	if (fork() == 0) init();	/* init in task1 */
@@ -144,6 +159,18 @@ void init(void) {
 	printf("%d buffers = %d bytes buffer space\n\r", NR_BUFFERS, NR_BUFFERS*BLOCK_SIZE);
 	printf("Free memory: %d bytes\n\r", mem_end-main_mem_start);
 	
+	if (!fork()) {		/* write-back task, bdflush() does not return */
+		close(0); close(1); close(2);
+		setsid();
+		_exit(bdflush());
+	}
+	
+	if (!fork()) {		/* page merging task, ksmd() does not return */
+		close(0); close(1); close(2);
+		setsid();
+		_exit(ksmd());
+	}
+	
 	if ((pid = fork()) == 0) {		/* task2 */
 		close(0);
 		if (open("/etc/rc", O_RDONLY, 0))
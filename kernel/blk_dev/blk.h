@@ -6,8 +6,83 @@
 #ifndef BLK_H_
 #define BLK_H_
 
-#define NR_BLK_DEV	7
-#define NR_REQUEST	16
+#define NR_BLK_DEV	9
+#define HD2_MAJOR		7	/* hd on the secondary IDE channel */
+#define VBLK_MAJOR	8	/* virtio-blk */
+
+/* 
+ * queue depths of blk_dev[] in rw_blk.c, per direction unless split in 
+ * reads and writes. the pool is their sum, so no device starves another.
+ */
+#define MEM_REQ		8
+#define FD_REQ		4
+#define HD_READ_REQ	24	/* each channel */
+#define HD_WRITE_REQ	16
+#define VBLK_REQ		16
+#define NR_REQUEST	(2 * MEM_REQ + 2 * FD_REQ + 2 * (HD_READ_REQ + HD_WRITE_REQ) + 2 * VBLK_REQ)
+
+#define MAX_MERGE		8	/* blocks in one request */
+#define WRITE_FUA		4	/* rw_blk() and sys_dio() command, beside READ ~ WRITEA */
+
+/* request flags */
+#define REQ_FLUSH		1	/* flush the write cache, no data, a barrier in the queue */
+#define REQ_FUA		2	/* write through the write cache */
+#define REQ_WRITTEN	4	/* driver's own, the data of a REQ_FUA is out, its flush is not */
+
+#define DIO_PAGES	16	/* pinned at once by a direct transfer */
+
+/* a direct transfer to user pages, see sys_dio() and sys_aio() */
+struct dio {
+	int nr;		/* requests not finished */
+	int error;
+	unsigned long bytes;	/* queued */
+	struct task_struct *wait;
+	void (*done)(struct dio *);	/* NULL -- wake up 'wait' */
+	unsigned long pages[DIO_PAGES];	/* pinned, physical */
+	int nr_pages;
+};
+
+/* argument of sys_dio(), shared with user space */
+struct dio_args {
+	unsigned long sector;
+	char *buf;		/* 512-byte aligned */
+	unsigned long count;	/* bytes, a multiple of 512 */
+};
+
+/* 
+ * the rings of sys_aio(), a page of user memory shared with the kernel. 
+ * the task fills sq[] and moves sq_tail, the kernel moves sq_head as it 
+ * takes them. the kernel fills cq[] and moves cq_tail, the task moves 
+ * cq_head as it takes them. heads and tails only grow.
+ */
+#define AIO_SETUP	0
+#define AIO_ENTER	1
+#define AIO_EXIT	2
+
+#define AIO_SQ_ENTRIES	64
+#define AIO_CQ_ENTRIES	128
+
+struct aio_sqe {
+	long cmd;		/* READ or WRITE */
+	long dev;
+	unsigned long sector;
+	char *buf;		/* 512-byte aligned */
+	unsigned long count;	/* bytes, a multiple of 512 */
+	unsigned long user_data;	/* given back in the completion */
+};
+
+struct aio_cqe {
+	unsigned long user_data;
+	long res;		/* bytes done, or -errno */
+};
+
+struct aio_ring {
+	unsigned long sq_head, sq_tail;
+	unsigned long cq_head, cq_tail;
+	unsigned long cq_overflow;	/* completions lost to a full cq[] */
+	struct aio_sqe sq[AIO_SQ_ENTRIES];
+	struct aio_cqe cq[AIO_CQ_ENTRIES];
+};
 
 /* request for both blk_dev and paging */
 struct request {
@@ -16,25 +91,95 @@ struct request {
 	int errors;
 	unsigned long sector;
 	unsigned long nr_sect;
-	char *buffer;
+	char *buffer;	/* where the next sector goes */
 	struct task_struct *waiting;
-	struct buffer_head *head;
+	struct buffer_head *bh[MAX_MERGE];	/* adjacent blocks in sector order */
+	int nr_bh, cur_bh;	/* nr_bh = 0 -- no buffers, 'buffer' is contiguous */
 	struct request *next;
+	long deadline;	/* jiffies, for the deadline elevator */
+	int ahead;		/* started by read-ahead, errors are not reported */
+	unsigned long queued, started;	/* usec_clock(), for the I/O statistics */
+	unsigned long xfer_sect;	/* sectors, when handed to the driver */
+	struct dio *dio;	/* NULL -- not a direct transfer, see sys_dio() */
+	int flags;		/* REQ_FLUSH, REQ_FUA, REQ_WRITTEN */
+};
+
+/* 
+ * I/O statistics of a major, the layout is shared with user space by 
+ * sys_iostat(). [2] is read, write. times are in microseconds, from 
+ * usec_clock() in kernel/sched.c, histogram bucket i > 0 counts times 
+ * in [2^(i-1), 2^i), the last one up from about 4 seconds.
+ */
+#define NR_LAT_BUCKET	24
+
+struct blk_stat {
+	unsigned long nr_req[2];		/* completed */
+	unsigned long nr_merge[2];		/* blocks added to a queued request */
+	unsigned long nr_sect[2];
+	unsigned long nr_error[2];
+	unsigned long wait_time[2];	/* queued to handed to the driver, us */
+	unsigned long serv_time[2];	/* handed to the driver to completed, us */
+	unsigned long depth, max_depth;	/* requests taken from the pool */
+	unsigned long wait_hist[2][NR_LAT_BUCKET];
+	unsigned long serv_hist[2][NR_LAT_BUCKET];
+};
+
+/* 
+ * I/O scheduler. 'add_request' puts 'req' somewhere after 'head', the 
+ * request being served, 'next_request' picks the request to be served 
+ * after 'head' is done.
+ */
+struct elevator {
+	char *name;
+	void (*add_request)(struct request *head, struct request *req);
+	struct request *(*next_request)(struct request *head);
 };
 
 struct blk_dev_struct {
 	void (*request_func)(void);
 	struct request *current_request;
+	struct elevator *elevator;
+	int plugged;		/* hold back dispatch while > 0 */
+	int plug_idle;		/* current_request not started yet */
+	int max_req[2];	/* queue depth for reads, writes */
+	int nr_req[2];		/* requests taken from the pool */
+	struct task_struct *wait_req[2];	/* waiting for the queue to drain */
+	int flush;			/* the driver takes REQ_FLUSH and REQ_FUA */
+	int barrier;		/* REQ_FLUSH queued, new requests go behind it */
+	unsigned long (*nr_blk)(int dev);	/* blocks of 'dev', NULL -- no read-ahead */
 };
 
+/* index into max_req[], nr_req[] and wait_req[] */
+#define RW_NR(cmd)	((cmd) == READ? 0: 1)
+
 extern struct blk_dev_struct blk_dev[NR_BLK_DEV];
 extern struct request request[NR_REQUEST];
 extern struct task_struct *wait_head;
 
+extern void plug_blk_dev(int major);
+extern void unplug_blk_dev(int major);
+extern void put_request(struct request *req);
+extern int blk_flush(int dev, int wait);
+extern void start_request(struct request *req);
+extern void account_request(struct request *req, int uptodate);
+extern char *dma_alloc(unsigned long size);
+extern void dma_free(char *buf);
+extern unsigned long pci_read(int dev, int fn, int reg);
+extern void pci_write(int dev, int fn, int reg, unsigned long val);
+
 /* major nr should be defined in the including file */
 #ifdef MAJOR_NR
 
-#if (MAJOR_NR == 2)
+#if (MAJOR_NR == 1)
+/* ram disk */
+#define DEV_NAME		"ramdisk"
+#define DEV_INT		do_rd
+#define DEV_REQUEST	do_rd_request
+#define DEV_NR(dev)	((dev) & 7)
+#define DEV_ON(dev)	
+#define DEV_OFF(dev)	
+
+#elif (MAJOR_NR == 2)
 /* floppy */
 #define DEV_NAME		"floppy"
 #define DEV_INT		do_floppy
@@ -44,24 +189,41 @@ extern struct task_struct *wait_head;
 #define DEV_OFF(dev)	floppy_off(DEV_NR(dev))
 
 #elif (MAJOR_NR == 3)
-/* hd */
+/* hd, both channels -- major 3 for hd0/1, HD2_MAJOR for hd2/3 */
+extern int hd_chan;	/* channel being served */
+#define QUEUE_NR		(hd_chan? HD2_MAJOR: MAJOR_NR)
 #define DEV_NAME		"hd"
 #define DEV_INT		do_hd
 #define DEV_REQUEST	do_hd_request
-#define DEV_NR(dev)	(MINOR(dev) / 5)
+#define DEV_NR(dev)	(MINOR(dev) / 5 + (MAJOR(dev) == HD2_MAJOR? 2: 0))
 #define DEV_ON(dev)	
 #define DEV_OFF(dev)	
 
-#elif
+#elif (MAJOR_NR == VBLK_MAJOR)
+/* virtio-blk, the whole disk only */
+#define DEV_NAME		"vd"
+#define DEV_INT		do_virtio_blk
+#define DEV_REQUEST	do_virtio_blk_request
+#define DEV_NR(dev)	MINOR(dev)
+#define DEV_ON(dev)	
+#define DEV_OFF(dev)	
+
+#else
 /* unknown */
 #error "unknown block device"
 
 #endif
 
-#define CURRENT		(blk_dev[MAJOR_NR].current_request)
+#ifndef QUEUE_NR
+#define QUEUE_NR		MAJOR_NR
+void (*DEV_INT)(void) = NULL;
+#else
+void (*DEV_INT[2])(void) = {NULL, NULL};		/* per channel */
+#endif
+
+#define CURRENT		(blk_dev[QUEUE_NR].current_request)
 #define CURRENT_DEV	DEV_NR(CURRENT->dev)
 
-void (*DEV_INT)(void) = NULL;
 static void (DEV_REQUEST)(void);
 
 extern inline void unlock_buffer(struct buffer_head *head) {
@@ -71,6 +233,59 @@ extern inline void unlock_buffer(struct buffer_head *head) {
 	wake_up(&head->b_wait);
 }
 
+/* move the current request on by 'nr' sectors, changing buffers at block ends */
+extern inline void advance_request(int nr) {
+	struct request *req = CURRENT;
+	
+	req->sector += nr;
+	req->nr_sect -= nr;
+	req->buffer += nr * 512;
+	if (req->cur_bh + 1 < req->nr_bh 
+		&& req->buffer >= req->bh[req->cur_bh]->b_data + BLOCK_SIZE)
+		req->buffer = req->bh[++req->cur_bh]->b_data;
+}
+
+/* 'req' is done, it still has to be given back with put_request() */
+extern inline void finish_request(struct request *req, int uptodate) {
+	int i;
+	
+	DEV_OFF(req->dev);
+	for (i = 0; i < req->nr_bh; ++i) {
+		req->bh[i]->b_update = uptodate;
+		unlock_buffer(req->bh[i]);
+	}
+	if (!uptodate && !req->ahead) {
+		printk(DEV_NAME " I/O error\n\r");
+		printk("dev %04x, sector %d\n\r", req->dev, req->sector);
+	}
+	wake_up(&req->waiting);
+	if (req->dio && !uptodate) req->dio->error = 1;
+	if (req->dio && !--req->dio->nr) {
+		if (req->dio->done)
+			(req->dio->done)(req->dio);
+		else
+			wake_up(&req->dio->wait);
+	}
+	account_request(req, uptodate);
+}
+
+extern inline void end_request(int uptodate) {
+	struct request *req = CURRENT;
+	
+	finish_request(req, uptodate);
+	CURRENT = (blk_dev[QUEUE_NR].elevator->next_request)(req);
+	if (CURRENT) start_request(CURRENT);
+	put_request(req);
+}
+
+#define INIT_REQUEST \
+loop: \
+	if (!CURRENT) return; \
+	if (MAJOR(CURRENT->dev) != QUEUE_NR) \
+		panic(DEV_NAME ": request list destroyed"); \
+	if (CURRENT->nr_bh && !CURRENT->bh[0]->b_lock) \
+		panic(DEV_NAME ": block not locked");
+
 #endif
 
 #endif
\ No newline at end of file
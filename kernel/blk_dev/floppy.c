@@ -19,6 +19,7 @@ static int reset = 0;
 static int seek = 0;
 
 extern unsigned char cur_DOR;	/* kernel/sched.c */
+extern unsigned long usec_clock(void);	/* kernel/sched.c */
 
 #define immountb_p(val,port) \
 	__asm__( \
@@ -34,6 +35,18 @@ extern unsigned char cur_DOR;	/* kernel/sched.c */
 
 #define MAX_ERRORS	8
 #define MAX_REPLIES	7
+/* 
+ * how long output_byte() and result() wait for the FDC. they run from the 
+ * interrupt and the timers, where neither sleeping nor jiffies work, so 
+ * the time comes from usec_clock(). kept under a tick, with interrupts 
+ * off usec_clock() only sees one tick pass.
+ */
+#define FD_POLL_US	5000
+#define FD_TIMEOUT	(3 * HZ)	/* no interrupt within, see floppy_watchdog() */
+
+static long fd_deadline = 0;
+#define SET_INTR(x) (do_floppy = (x), fd_deadline = jiffies + FD_TIMEOUT)
+
 static unsigned char reply_buffer[MAX_REPLIES];
 #define ST0 (reply_buffer[0])
 #define ST1 (reply_buffer[1])
@@ -58,7 +71,24 @@ static struct floppy_struct {
 };
 
 extern void floppy_int(void);		/* kernel/syscall.asm */
-extern char tmp_floppy_area[1024];		/* boot/head.asm */
+
+/* 
+ * whole-track cache. a read miss reads both heads of the cylinder in one 
+ * multi-track command, the following reads there are copied from memory. 
+ */
+#define TRACK_SIZE	(18 * 2 * 512)	/* 1.44MB diskette */
+static char *track_buf = NULL;		/* from the DMA pool */
+static int track_dev = -1;		/* -1 -- nothing cached */
+static unsigned char track_cyl = 0;
+static int track_read = 0;		/* the command in progress fills track_buf */
+
+/* 
+ * a command moves up to the rest of the cylinder. the request buffer is 
+ * used for DMA when it is contiguous and reachable, else 'bounce_buf'.
+ */
+static char *bounce_buf = NULL;		/* from the DMA pool, a cylinder */
+static int xfer_nr = 0;		/* sectors in the command in progress */
+static char *xfer_buf = NULL;	/* NULL -- no bounce */
 
 static int cur_arg = -1;
 static int cur_rate = -1;
@@ -83,7 +113,11 @@ loop:
 		int_sleep_on(&wait);		/* interruptible sleep */
 	if ((cur_DOR & 3) != nr) goto loop;
 	floppy_off(nr);
-	if (inb(FLOPPY_DIR) & 0x80) return 1;
+	if (inb(FLOPPY_DIR) & 0x80) {
+		if (track_dev >= 0 && DRIVE(MINOR(track_dev)) == nr)
+			track_dev = -1;
+		return 1;
+	}
 	return 0;
 }
 
@@ -93,16 +127,58 @@ loop:
 		:: "c"(BLOCK_SIZE / 4), "S"((long)(src)), "D"((long)(dest)) \
 		: "cx", "di", "si")
 		
+#define copy_sector(src,dest) \
+	__asm__("cld; rep; movsl" \
+		:: "c"(512 / 4), "S"((long)(src)), "D"((long)(dest)) \
+		: "cx", "di", "si")
+
+/* copy 'nr' sectors between 'buf' and the request, from where it is now */
+static void copy_request(char *buf, int nr, int to_req) {
+	char *p = CURRENT->buffer;
+	int bh = CURRENT->cur_bh;
+	
+	for (; nr > 0; --nr, buf += 512) {
+		if (to_req)
+			copy_sector(buf, p);
+		else 
+			copy_sector(p, buf);
+		p += 512;
+		if (bh + 1 < CURRENT->nr_bh && p >= CURRENT->bh[bh]->b_data + BLOCK_SIZE)
+			p = CURRENT->bh[++bh]->b_data;
+	}
+}
+
+/* can the next 'xfer_nr' sectors go straight to the request buffer */
+static int zero_copy(void) {
+	unsigned long addr = (unsigned long)CURRENT->buffer, len = xfer_nr * 512;
+	
+	if (CURRENT->nr_bh 
+		&& CURRENT->buffer + len > CURRENT->bh[CURRENT->cur_bh]->b_data + BLOCK_SIZE)
+		return 0;
+	return addr + len <= 0x100000 && !((addr ^ (addr + len - 1)) & 0xffff0000);
+}
+
 static void setup_DMA(void) {
-	long addr = (long)CURRENT->buffer;
+	long addr, count;
 	
 	cli();
 	/* set DMA buffer */
-	if (addr >= 0x100000) {
-		addr = (long)tmp_floppy_area;
-		if (command == FLOPPY_WRITE)
-			copy_buffer(CURRENT->buffer, tmp_floppy_area);
+	if (track_read) {
+		addr = (long)track_buf;
+		count = floppy->sector * floppy->head * 512;
+	} else {
+		count = xfer_nr * 512;
+		if (zero_copy()) {
+			xfer_buf = NULL;
+			addr = (long)CURRENT->buffer;
+		} else {
+			xfer_buf = bounce_buf;
+			addr = (long)bounce_buf;
+			if (cmd == FLOPPY_WRITE)
+				copy_request(bounce_buf, xfer_nr, 0);
+		}
 	}
+	count--;
 	/* mask DMA2 */
 	immountb_p(4 | 2, 10);
 	/* output command byte */
@@ -117,53 +193,55 @@ static void setup_DMA(void) {
 		"1:\t"
 		"jmp 1f			\n"
 		"1:\t"
-		:: "a"((char)((command == FLOPPY_READ)? DMA_READ: DMA_WRITE)));
+		:: "a"((char)((cmd == FLOPPY_READ)? DMA_READ: DMA_WRITE)));
 	immountb_p(addr, 4);		/* DMA2 base/current address register */
 	addr >>= 8;
 	immountb_p(addr, 4);
 	addr >>= 8;
 	immountb_p(addr, 0x81);	/* page register */
-	immountb_p(0xff, 5);		/* DMA2 base/current byte count */
-	immountb_p(0x03, 5);
+	immountb_p(count, 5);		/* DMA2 base/current byte count */
+	immountb_p(count >> 8, 5);
 	immountb_p(0 | 2, 10);	/* activate DMA2 */
 	sti();
 }
 
 /* output a byte to FDC */
 static void output_byte(char byte) {
-	int i;
+	unsigned long start = usec_clock();
 	unsigned char status;
 	
 	if (reset) return;
-	for (i = 0; i < 10000; ++i) {
+	do {
 		status = inb_p(FLOPPY_STATUS) & (READY_STAT | STAT_DIR);
-		if (status = READY_STAT) {
+		if (status == READY_STAT) {
 			outb(byte, FLOPPY_DATA);
 			return;
 		}
-	}
+	} while (usec_clock() - start < FD_POLL_US);
 	reset = 1;
 	printk("Unable to send byte to FDC\n\r");
 }
 
 static int result(void) {
-	int i, j = 0, status;
+	unsigned long start = usec_clock();
+	int j = 0, status;
 	
 	if (reset) return -1;
-	for (i = 0; i < 10000; ++i) {
+	do {
 		status = inb_p(FD_STATUS) & (STAT_DIR | READY_STAT | BUSY_STAT);
 		if (status == READY_STAT) return j;
 		if (status == (STAT_DIR | READY_STAT | BUSY_STAT)) {
 			if (j >= MAX_REPLIES) break;
 			reply_buffer[j++] = inb_p(FLOPPY_DATA);
 		}
-	}
+	} while (usec_clock() - start < FD_POLL_US);
 	reset = 1;
 	printk("Geting status times out\n\r");
 	return -1;
 }
 
 static void bad_floppy_int(void) {
+	track_read = 0;
 	CURRENT->errors++;
 	if (CURRENT->errors > MAX_ERRORS) {
 		floppy_deselect(cur_drive);
@@ -188,21 +266,43 @@ static void rw_int(void) {
 		return;
 	}
 	
-	if (cmd == FLOPPY_READ && (unsigned long)(CURRENT->buffer) >= 0x100000)
-		copy_buffer(tmp_floppy_area, CURRENT->buffer);
+	if (track_read) {		/* served from the cache by do_floppy_request() */
+		track_read = 0;
+		track_dev = CURRENT->dev;
+		track_cyl = track;
+		floppy_deselect(cur_drive);
+		do_floppy_request();
+		return;
+	}
+	if (cmd == FLOPPY_READ && xfer_buf)
+		copy_request(xfer_buf, xfer_nr, 1);
 	floppy_deselect(cur_drive);
+	CURRENT->errors = 0;
+	while (xfer_nr-- > 0)
+		advance_request(1);
+	if (CURRENT->nr_sect) {		/* merged request beyond this cylinder */
+		do_floppy_request();
+		return;
+	}
 	end_request(1);
 	do_floppy_request();
 }
 
 inline void setup_floppy(void) {
 	setup_DMA();
-	do_floppy = rw_int;
+	SET_INTR(rw_int);
 	output_byte(cmd);
-	output_byte(head << 2 | cur_drive);
-	output_byte(track);
-	output_byte(head);
-	output_byte(sector);
+	if (track_read) {		/* from head 0 sector 1 to the end of head 1 */
+		output_byte(cur_drive);
+		output_byte(track);
+		output_byte(0);
+		output_byte(1);
+	} else {
+		output_byte(head << 2 | cur_drive);
+		output_byte(track);
+		output_byte(head);
+		output_byte(sector);
+	}
 	output_byte(2);		/* sector size: 512 */
 	output_byte(floppy->sector);
 	output_byte(floppy->gap);
@@ -239,7 +339,7 @@ static void transfer(void) {
 		setup_floppy();
 		return;
 	}
-	do_floppy = seek_int;
+	SET_INTR(seek_int);
 	if (seek_track) {
 		output_byte(FLOPPY_SEEK);
 		output_byte(head << 2 | cur_drive);
@@ -271,7 +371,7 @@ void unexpected_floppy_int(void) {
 static void recal_floppy(void) {
 	recal_flag = 0;
 	cur_track = 0;
-	do_floppy = recal_int;
+	SET_INTR(recal_int);
 	output_byte(FLOPPY_RECAL);
 	output_byte(head << 2 | cur_drive);
 	if (reset) do_floppy_request();
@@ -290,18 +390,35 @@ static void reset_floppy(void) {
 	int i;
 	
 	reset = 0;
+	track_dev = -1;
 	cur_arg = -1;
 	cur_rate = -1;
 	recal_flag = 1;
 	printk("reset_floppy called\n\r");
 	cli();
-	do_floppy = reset_int;
+	SET_INTR(reset_int);
 	outb_p(cur_DOR & ~0x04, FLOPPY_DOR);
 	for (i = 0; i < 100; ++i) __asm__("nop");
 	outb(cur_DOR, FLOPPY_DOR);
 	sti();
 }
 
+/* 
+ * called by do_timer() on every tick. a lost interrupt would leave the 
+ * request hanging, so the controller is reset and the request retried.
+ */
+void floppy_watchdog(void) {
+	if (!do_floppy || jiffies < fd_deadline) return;
+	do_floppy = NULL;
+	printk("floppy: timeout\n\r");
+	track_read = 0;
+	reset = 1;
+	if (sel) floppy_deselect(cur_drive);
+	if (CURRENT && ++CURRENT->errors > MAX_ERRORS)
+		end_request(0);
+	do_floppy_request();
+}
+
 static void floppy_on_int(void) {
 	sel = 1;
 	if (cur_drive != (cur_DOR & 3)) {
@@ -316,6 +433,7 @@ static void floppy_on_int(void) {
 
 void do_floppy_request(void) {
 	unsigned int blk;
+	int nr;
 	
 	seek = 0;
 	if (reset) {
@@ -332,7 +450,7 @@ void do_floppy_request(void) {
 	if (cur_drive != CURRENT_DEV) seek = 1;
 	cur_drive = CURRENT_DEV;
 	blk = CURRENT->sector;
-	if (blk > floppy->size - 2) {
+	if (blk + CURRENT->nr_sect > floppy->size) {
 		end_request(0);
 		goto loop;
 	}
@@ -345,18 +463,49 @@ void do_floppy_request(void) {
 	if (seek_track != cur_track) seek = 1;
 	sector++;
 	
-	if (CURRENT->cmd == READ)
+	if (CURRENT->cmd == READ) {
 		cmd = FLOPPY_READ;
-	else if (CURRENT->cmd == WRITE)
+		if (track_dev == CURRENT->dev && track_cyl == track) {
+			/* up to the end of the cylinder, a dio may be a single sector */
+			nr = floppy->sector * floppy->head - (head * floppy->sector + sector - 1);
+			if (nr > CURRENT->nr_sect) nr = CURRENT->nr_sect;
+			copy_request(track_buf + ((head * floppy->sector + sector - 1) << 9), nr, 1);
+			while (nr-- > 0)
+				advance_request(1);
+			if (!CURRENT->nr_sect)
+				end_request(1);
+			goto loop;
+		}
+		track_read = (track_buf && floppy->sector * floppy->head * 512 <= TRACK_SIZE);
+	} else if (CURRENT->cmd == WRITE) {
 		cmd = FLOPPY_WRITE;
-	else 
+		track_read = 0;
+		if (track_dev == CURRENT->dev && track_cyl == track)
+			track_dev = -1;
+	} else {
 		panic("do_floppy_request: unknown command");
-		
+	}
+	/* the rest of the request, up to the end of the cylinder */
+	xfer_nr = floppy->sector * floppy->head - (head * floppy->sector + sector - 1);
+	if (xfer_nr > CURRENT->nr_sect) xfer_nr = CURRENT->nr_sect;
+	
 	add_timer(ticks_to_floppy_on(cur_drive), &floppy_on_int);
 }
 
-void floppy_int(void) {
+/* blocks of the diskette type of 'dev', for read-ahead */
+static unsigned long floppy_nr_blk(int dev) {
+	if ((MINOR(dev) >> 2) >= sizeof(floppy_type) / sizeof(struct floppy_struct))
+		return 0;
+	return floppy_type[MINOR(dev) >> 2].size >> 1;
+}
+
+void floppy_init(void) {
 	blk_dev[MAJOR_NR].request_func = DEVICE_REQUEST;
+	blk_dev[MAJOR_NR].nr_blk = &floppy_nr_blk;
+	if (!(bounce_buf = dma_alloc(TRACK_SIZE)))
+		panic("floppy: no DMA buffer");
+	if (!(track_buf = dma_alloc(TRACK_SIZE)))
+		printk("floppy: no track cache\n\r");
 	set_trap_gate(0x26, &floppy_int);
 	outb(intb_p(0x21) & 0xbf, 0x21);	/* master 8259A, IRQ6(floppy) allowed */
 }
\ No newline at end of file
@@ -21,29 +21,69 @@
 })
 
 #define MAX_ERRORS	7
-#define MAX_HD			2
+#define HD_POLL		100		/* status reads before waiting on the timer */
+#define HD_TIMEOUT	(5 * HZ)	/* watchdog for a command or a wait */
+#define HD_FLUSH_TIMEOUT	(30 * HZ)	/* FLUSH CACHE may take long */
+#define MAX_HD			4		/* master and slave on each channel */
+#define HD_DRIVE(chan, unit)	(((chan) & 1) * 2 + ((unit) & 1))	/* index into hd_info[] */
+
+/* ATA commands beyond include/mirix/hd_arg.h */
+#define WIN_MULTREAD	0xc4
+#define WIN_MULTWRITE	0xc5
+#define WIN_SETMULT		0xc6
+#define WIN_IDENTIFY	0xec
+#define WIN_READ_EXT		0x24		/* LBA48 */
+#define WIN_WRITE_EXT		0x34
+#define WIN_MULTREAD_EXT	0x29
+#define WIN_MULTWRITE_EXT	0x39
+#define WIN_READ_DMA		0xc8
+#define WIN_WRITE_DMA		0xca
+#define WIN_READ_DMA_EXT	0x25
+#define WIN_WRITE_DMA_EXT	0x35
+#define WIN_WRITE_DMA_FUA_EXT	0x3d	/* LBA48 only */
+#define WIN_MULTWRITE_FUA_EXT	0xce
+#define WIN_FLUSH_CACHE		0xe7
+#define WIN_FLUSH_CACHE_EXT	0xea
+#define WIN_SETFEATURES		0xef	/* feature 0x02 -- write cache on */
+
+/* PCI IDE bus master registers, primary channel, from BAR4 */
+#define BM_COMMAND	0		/* bit 0 -- start, bit 3 -- write to memory */
+#define BM_STATUS		2		/* bit 0 -- active, bit 1 -- error, bit 2 -- irq */
+#define BM_PRD		4		/* physical address of the PRD table */
+
+/* device nr of a whole drive, hd2/3 are on the secondary channel */
+#define HD_DEV(drive)	((drive) < 2? 0x300 + (drive) * 5: \
+	(HD2_MAJOR << 8) + ((drive) - 2) * 5)
+
+/* the task file of the channel being served, hd_arg.h has the primary one */
+#define HD_IO(port)	((port) - 0x80 * hd_chan)
 
 static void recal_int(void);
-static int recal_flag = 1;
-static int reset = 1;
 
 struct hd_info_struct {
 	int head, sector, cylind;
 	int wpcom, lzone, ctrl;
 	/* writing pre-compensation, landing zone, control byte */
+	int mult;		/* sectors per interrupt, 0 -- no READ/WRITE MULTIPLE */
+	int lba;		/* 28, 48, 0 -- CHS only */
+	unsigned long lba_sect;		/* sectors addressable by LBA */
+	int dma;		/* bus master DMA usable */
+	int wcache;		/* write cache on */
+	int flush;		/* FLUSH CACHE command, 0 -- nothing to flush */
+	int fua;		/* FUA writes, LBA48 */
 };
 
 #ifdef HD_TYPE
-struct hd_info_struct hd_info[] = { HD_TYPE };
-#define NR_HD	(sizeof(hd_info) / sizeof(struct hd_info_struct))
+struct hd_info_struct hd_info[MAX_HD] = { HD_TYPE };
+#define NR_HD	(sizeof((struct hd_info_struct []){ HD_TYPE }) / sizeof(struct hd_info_struct))
 #else
-struct hd_info_struct hd_info[] = {{0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0}};
+struct hd_info_struct hd_info[MAX_HD] = {{0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 0, 0}};
 static int NR_HD = 0;
 #endif
 
 static struct hd_struct {
-	long start_sect;
-	long nr_sect;
+	unsigned long start_sect;
+	unsigned long nr_sect;
 } hd[5*MAX_HD] = {{0, 0}, };
 
 #define p_read(port,buf,nr) \
@@ -53,6 +93,48 @@ static struct hd_struct {
 	__asm__("cld; rep; outsw"::"d"(port), "S"(buf), "c"(nr): "cx", "si")
 	
 extern void hd_int(void);		/* kernel/syscall.asm */
+extern void hd2_int(void);
+extern void rd_load(void);		/* kernel/blk_dev/ramdisk.c */
+
+static unsigned short hd_ident[256];	/* IDENTIFY data */
+
+static int hd_identify(int drive);
+
+/* physical region descriptor, one per contiguous piece of the request */
+struct prd {
+	unsigned long addr;
+	unsigned short count;	/* bytes, 0 -- 64K */
+	unsigned short flags;	/* 0x8000 -- last entry */
+};
+
+/* must not cross a 64K boundary, 16 entries are 128 bytes */
+static struct prd prd_table[2][16] __attribute__((aligned(256)));
+
+/* 
+ * state of each channel. the two run at the same time, all entries set 
+ * 'hd_chan' and the interrupt puts back the value it found.
+ */
+static struct hd_chan_struct {
+	int reset, recal_flag;
+	int cur_mult;		/* sectors per interrupt of the command in progress */
+	int fua_flush;		/* a REQ_FUA written without FUA, FLUSH CACHE after it */
+	/* where the block being written started, to go back there on an error */
+	unsigned long wr_sector, wr_nr_sect;
+	char *wr_buffer;
+	int wr_bh;
+	unsigned short bm_base;	/* 0 -- no bus master IDE controller */
+	void (*wait_fn)(void);	/* called once the status matches, see hd_wait() */
+	int wait_mask, wait_want;
+	long deadline;		/* jiffies, for wait_fn or the interrupt */
+} hd_chans[2] = {{1, 1, 1}, {1, 1, 1}};
+
+int hd_chan = 0;
+#define CHAN	(hd_chans[hd_chan])
+
+/* expect the interrupt of the channel within HD_TIMEOUT */
+#define SET_INTR(x) (do_hd[hd_chan] = (x), CHAN.deadline = jiffies + HD_TIMEOUT)
+
+static void hd_start(void);
 
 /* set 'hd' and load root system */
 int sys_setup(void *BIOS) {
@@ -101,10 +183,22 @@ int sys_setup(void *BIOS) {
 		hd[i*5].start_sect = 0;
 		hd[i*5].nr_sect = 0;
 	}
+	for (drive = 0; drive < NR_HD; ++drive) {
+		hd_identify(drive);
+		if (hd_info[drive].lba)		/* may be beyond the CHS limit */
+			hd[drive*5].nr_sect = hd_info[drive].lba_sect;
+	}
+	/* no BIOS geometry for the secondary channel, only LBA drives are used */
+	for (drive = 2; drive < MAX_HD; ++drive)
+		if (hd_identify(drive) && hd_info[drive].lba) {
+			hd[drive*5].nr_sect = hd_info[drive].lba_sect;
+			printk("hd%d: on the secondary channel\n\r", drive);
+		}
 	
 	/* get the partition table */
-	for (drive = 0; drive < NR_ND; ++drive) {
-		if (!(head = bread(0x300 + drive * 5, 0))) {
+	for (drive = 0; drive < MAX_HD; ++drive) {
+		if (!hd[drive*5].nr_sect) continue;
+		if (!(head = bread(HD_DEV(drive), 0))) {
 			printk("Unable to read partition table of drive %d\n\r", drive);
 			panic("");
 		}
@@ -123,22 +217,35 @@ int sys_setup(void *BIOS) {
 	}
 	
 	if (NR_HD) printk("Partition table%c ok. \n\r", (NR_HD > 1)? 's': '\0');
+	rd_load();		/* kernel/blk_dev/ramdisk.c */
 	mount_root();		/* fs/super.c */
 	return 0;
 }
 
-static int controller_ready(void) {
-	int retries = 10000;
-	while (--retries && (inb_p(HD_STATUS) & 0xc0) != 0x40);
-	return retries;
+/* 
+ * call 'fn' once (status & mask) == want. only HD_POLL reads are done 
+ * here, after that hd_timer() looks again on each tick, up to HD_TIMEOUT.
+ */
+static void hd_wait(int mask, int want, void (*fn)(void)) {
+	int retries = HD_POLL;
+	
+	while (--retries && (inb_p(HD_IO(HD_STATUS)) & mask) != want) continue;
+	if (retries) {
+		fn();
+		return;
+	}
+	CHAN.wait_mask = mask;
+	CHAN.wait_want = want;
+	CHAN.deadline = jiffies + HD_TIMEOUT;
+	CHAN.wait_fn = fn;
 }
 
 static int win_result(void) {
-	int i = inb_p(HD_STATUS);
+	int i = inb_p(HD_IO(HD_STATUS));
 	if ((i & (BUSY_STAT | READY_STAT | WRERR_STAT | SEEK_STAT | ERR_STAT)) 
 		== (READY_STAT | SEEK_STAT))
 		return 0;
-	if (i & ERR_STAT) i = inb(HD_ERROR);
+	if (i & ERR_STAT) i = inb(HD_IO(HD_ERROR));
 	return 1;
 }
 
@@ -148,96 +255,390 @@ static void hd_out(unsigned int drive, unsigned int nr,
 	unsigned int cmd, void (*intr)(void)) {
 	register int port asm("dx");
 	
-	if (drive > 1 || head > 15)
+	if (drive >= MAX_HD || head > 15)
 		panic("Trying to write a bad sector");
-	if(!controller_ready())
-		panic("hd controller not ready");
 		
-	do_hd = intr;
-	outb_p(hd_info[drive].ctrl, HD_CMD);
-	port = HD_DATA;
+	SET_INTR(intr);
+	outb_p(hd_info[drive].ctrl, HD_IO(HD_CMD));
+	port = HD_IO(HD_DATA);
 	outb_p(hd_info[drive].wpcom >> 2, ++port);
 	outb_p(nr, ++port);
 	outb_p(sector, ++port);
 	outb_p(cylind, ++port);
 	outb_p(cylind >> 8, ++port);
-	outb_p((drive << 4) | 0xa0, ++port);
+	outb_p(((drive & 1) << 4) | 0xa0, ++port);
 	outb(cmd, ++port);
 }
 
-static int drive_busy(void) {
-	unsigned int i;
-	for (i = 0; i < 10000; ++i)
-		if ((inb_p(HD_STATUS) & (BUSY_STAT | READY_STAT)) == READY_STAT) break;
-	i = inb(HD_STATUS);
-	i &= BUSY_STAT | READY_STAT | SEEK_STAT;
-	if (i == READY_STAT | SEEK_STAT) return 0;
-	printk("hd controller times out\n\r");
-	return 1;
+/* sent commands to hd controller with the sector given by LBA */
+static void hd_out_lba(unsigned int drive, unsigned int nr, unsigned long lba, 
+	unsigned int cmd, void (*intr)(void)) {
+	register int port asm("dx");
+	
+	if (drive >= MAX_HD)
+		panic("Trying to write a bad sector");
+		
+	SET_INTR(intr);
+	outb_p(hd_info[drive].ctrl, HD_IO(HD_CMD));
+	port = HD_IO(HD_NSECTOR);
+	if (lba + nr <= 0x10000000 
+		&& cmd != WIN_WRITE_DMA_FUA_EXT && cmd != WIN_MULTWRITE_FUA_EXT) {
+		outb_p(nr, port);
+		outb_p(lba, ++port);
+		outb_p(lba >> 8, ++port);
+		outb_p(lba >> 16, ++port);
+		outb_p(0xe0 | ((drive & 1) << 4) | ((lba >> 24) & 0x0f), ++port);
+		outb(cmd, ++port);
+		return;
+	}
+	
+	/* LBA48, the high order bytes go first, sectors are 32-bit here */
+	if (hd_info[drive].lba != 48)
+		panic("Trying to write a bad sector");
+	outb_p(nr >> 8, port);
+	outb_p(lba >> 24, ++port);
+	outb_p(0, ++port);
+	outb_p(0, ++port);
+	port = HD_IO(HD_NSECTOR);
+	outb_p(nr, port);
+	outb_p(lba, ++port);
+	outb_p(lba >> 8, ++port);
+	outb_p(lba >> 16, ++port);
+	outb_p(0x40 | ((drive & 1) << 4), ++port);
+	switch (cmd) {
+	case WIN_READ: cmd = WIN_READ_EXT; break;
+	case WIN_WRITE: cmd = WIN_WRITE_EXT; break;
+	case WIN_MULTREAD: cmd = WIN_MULTREAD_EXT; break;
+	case WIN_MULTWRITE: cmd = WIN_MULTWRITE_EXT; break;
+	case WIN_READ_DMA: cmd = WIN_READ_DMA_EXT; break;
+	case WIN_WRITE_DMA: cmd = WIN_WRITE_DMA_EXT; break;
+	}
+	outb(cmd, ++port);
 }
 
-static void reset_controller(void) {
-	int i;
-	outb(4, HD_CMD);		/* 4 -- reset */
-	for (i = 0; i < 100; ++i) nop();
-	outb(hd_info[0].ctrl & 0x0f, HD_CMD);
-	if (drive_busy()) 
-		printk("hd controller still busy\n\r");
-	if ((i = inb(HD_ERROR)) != 1)
-		printk("hd controller reset failed: %02x\n\r", i);
+/* polled wait used while setting up, when the drive interrupt is masked */
+static int hd_poll(int mask, int want) {
+	int retries = 100000;
+	while (--retries && (inb_p(HD_IO(HD_STATUS)) & mask) != want) continue;
+	return retries;
+}
+
+/* find a bus master capable IDE controller on PCI bus 0 (PIIX3/4 etc.) */
+static void bm_probe(void) {
+	int dev, fn;
+	unsigned long class, bar;
+	
+	for (dev = 0; dev < 32; ++dev)
+		for (fn = 0; fn < 8; ++fn) {
+			if ((pci_read(dev, fn, 0) & 0xffff) == 0xffff) continue;
+			class = pci_read(dev, fn, 8) >> 8;
+			/* class 01 subclass 01 -- IDE, prog-if bit 7 -- bus master */
+			if ((class >> 8) != 0x0101 || !(class & 0x80)) continue;
+			bar = pci_read(dev, fn, 0x20);	/* BAR4 */
+			if (!(bar & 1) || !(bar & 0xfffc)) continue;
+			pci_write(dev, fn, 4, pci_read(dev, fn, 4) | 0x05);	/* I/O, bus master */
+			hd_chans[0].bm_base = bar & 0xfffc;
+			hd_chans[1].bm_base = (bar & 0xfffc) + 8;	/* secondary channel */
+			printk("hd: bus master IDE at %04x\n\r", hd_chans[0].bm_base);
+			return;
+		}
+}
+
+/* 
+ * fill the PRD table from the current request, following its buffers the 
+ * way advance_request() does. nr_bh = 0 buffers are contiguous.
+ */
+static void bm_setup(void) {
+	struct request *req = CURRENT;
+	char *buf = req->buffer;
+	int bh = req->cur_bh;
+	unsigned long left = req->nr_sect * 512, n;
+	struct prd *p = prd_table[hd_chan];
+	
+	while (left) {
+		if (req->nr_bh)
+			n = req->bh[bh]->b_data + BLOCK_SIZE - buf;
+		else
+			n = 0x10000 - ((unsigned long)buf & 0xffff);	/* up to the 64K boundary */
+		if (n > left) n = left;
+		/* adjacent blocks inside one 64K piece share an entry */
+		if (p > prd_table[hd_chan] && p[-1].addr + p[-1].count == (unsigned long)buf 
+			&& !((p[-1].addr ^ ((unsigned long)buf + n - 1)) & 0xffff0000)) {
+			p[-1].count += n;
+		} else {
+			p->addr = (unsigned long)buf;	/* kernel memory is identity mapped */
+			p->count = n;
+			p->flags = 0;
+			++p;
+		}
+		left -= n;
+		if (req->nr_bh && left)
+			buf = req->bh[++bh]->b_data;
+		else
+			buf += n;
+	}
+	p[-1].flags = 0x8000;
+	
+	__asm__("outl %%eax, %%dx"::"a"(prd_table[hd_chan]), "d"(CHAN.bm_base + BM_PRD));
+	outb_p(0x06, CHAN.bm_base + BM_STATUS);		/* clear error and irq */
+	outb_p(req->cmd == READ? 0x08: 0x00, CHAN.bm_base + BM_COMMAND);
+}
+
+/* 
+ * IDENTIFY the drive, pick LBA28 or LBA48 addressing when it is 
+ * supported, and enable the largest READ/WRITE MULTIPLE block
+ */
+static int hd_identify(int drive) {
+	int mult, found = 0;
+	
+	if (drive >= MAX_HD) return 0;
+	hd_chan = drive >> 1;
+	hd_info[drive].mult = 0;
+	hd_info[drive].lba = 0;
+	hd_info[drive].dma = 0;
+	hd_info[drive].wcache = 0;
+	hd_info[drive].flush = 0;
+	hd_info[drive].fua = 0;
+	outb_p(hd_info[drive].ctrl | 0x02, HD_IO(HD_CMD));	/* 0x02 -- nIEN, no interrupt */
+	outb_p(((drive & 1) << 4) | 0xa0, HD_IO(HD_CURRENT));
+	if (!hd_poll(BUSY_STAT, 0)) goto out;
+	outb_p(WIN_IDENTIFY, HD_IO(HD_COMMAND));
+	if (!hd_poll(BUSY_STAT | DRQ_STAT, DRQ_STAT)) goto out;
+	port_read(HD_IO(HD_DATA), hd_ident, 256);
+	found = 1;
+	if (hd_ident[49] & 0x200) {		/* word 49 bit 9 -- LBA */
+		hd_info[drive].lba = 28;
+		hd_info[drive].lba_sect = hd_ident[60] | ((unsigned long)hd_ident[61] << 16);
+		if (hd_ident[83] & 0x400) {		/* word 83 bit 10 -- LBA48 */
+			hd_info[drive].lba = 48;
+			if (hd_ident[102] || hd_ident[103])
+				hd_info[drive].lba_sect = 0xffffffff;
+			else
+				hd_info[drive].lba_sect = hd_ident[100] | ((unsigned long)hd_ident[101] << 16);
+		}
+		printk("hd%d: LBA%d, %u sectors\n\r", drive, hd_info[drive].lba, hd_info[drive].lba_sect);
+	}
+	/* word 49 bit 8 -- DMA, with a mode enabled in word 63 or 88 */
+	if (CHAN.bm_base && (hd_ident[49] & 0x100) 
+		&& ((hd_ident[63] & 0x0700) || (hd_ident[88] & 0x7f00))) {
+		hd_info[drive].dma = 1;
+		printk("hd%d: bus master DMA\n\r", drive);
+	}
+	/* word 82 bit 5 -- write cache, turned on rather than left to the drive */
+	if (hd_ident[82] & 0x20) {
+		outb_p(0x02, HD_IO(HD_ERROR));		/* features */
+		outb_p(((drive & 1) << 4) | 0xa0, HD_IO(HD_CURRENT));
+		outb_p(WIN_SETFEATURES, HD_IO(HD_COMMAND));
+		if (hd_poll(BUSY_STAT, 0) && !(inb_p(HD_IO(HD_STATUS)) & ERR_STAT))
+			hd_info[drive].wcache = 1;
+	}
+	/* word 85 bit 5 -- write cache on, whoever turned it on */
+	if (hd_info[drive].wcache || (hd_ident[85] & 0x20)) {
+		/* word 83 bit 13 -- FLUSH CACHE EXT, word 84 bit 6 -- FUA */
+		hd_info[drive].flush = (hd_info[drive].lba == 48 && (hd_ident[83] & 0x2000))? 
+			WIN_FLUSH_CACHE_EXT: WIN_FLUSH_CACHE;
+		hd_info[drive].fua = (hd_info[drive].lba == 48 && (hd_ident[84] & 0x40));
+		printk("hd%d: write cache on%s\n\r", drive, hd_info[drive].fua? ", FUA": "");
+	}
+	if (!(mult = hd_ident[47] & 0xff)) goto out;	/* word 47 -- max sectors per interrupt */
+	outb_p(mult, HD_IO(HD_NSECTOR));
+	outb_p(((drive & 1) << 4) | 0xa0, HD_IO(HD_CURRENT));
+	outb_p(WIN_SETMULT, HD_IO(HD_COMMAND));
+	if (!hd_poll(BUSY_STAT, 0) || (inb_p(HD_IO(HD_STATUS)) & ERR_STAT)) goto out;
+	hd_info[drive].mult = mult;
+	printk("hd%d: %d sectors per interrupt\n\r", drive, mult);
+out:
+	outb_p(hd_info[drive].ctrl, HD_IO(HD_CMD));
+	return found;
 }
 
-static void reset_hd(int drive) {
-	reset_controller();
+/* the controller is ready again after a reset, SPECIFY the drive */
+static void reset_done(void) {
+	int i, drive;
+	
+	if ((i = inb(HD_IO(HD_ERROR))) != 1)
+		printk("hd controller reset failed: %02x\n\r", i);
+	if (!CURRENT) return;
+	drive = CURRENT_DEV;
+	if (!hd_info[drive].head) {		/* LBA only, nothing to SPECIFY */
+		hd_start();
+		return;
+	}
 	hd_out(drive, hd_info[drive].sector,
 		hd_info[drive].sector, hd_info[drive].head - 1, hd_info[drive].cylind, 
 		WIN_SPECIFY, &recal_int);
 }
 
+static void reset_hd(void) {
+	int i;
+	
+	outb(4, HD_IO(HD_CMD));		/* 4 -- reset */
+	for (i = 0; i < 100; ++i) nop();
+	outb(hd_info[HD_DRIVE(hd_chan, 0)].ctrl & 0x0f, HD_IO(HD_CMD));
+	hd_wait(BUSY_STAT | READY_STAT, READY_STAT, &reset_done);
+}
+
+/* no interrupt, or the status never came, reset the channel */
+static void hd_times_out(void) {
+	printk("hd%d: timeout\n\r", HD_DRIVE(hd_chan, 0));
+	do_hd[hd_chan] = NULL;
+	if (CHAN.bm_base)
+		outb_p(0x00, CHAN.bm_base + BM_COMMAND);
+	CHAN.reset = 1;
+	if (CURRENT && ++CURRENT->errors >= MAX_ERRORS)
+		end_request(0);
+	do_hd_request();
+}
+
+/* called by do_timer() on every tick, the watchdog and the slow waits */
+void hd_timer(void) {
+	int old = hd_chan;
+	void (*fn)(void);
+	
+	for (hd_chan = 0; hd_chan < 2; ++hd_chan) {
+		if ((fn = CHAN.wait_fn)) {
+			if ((inb_p(HD_IO(HD_STATUS)) & CHAN.wait_mask) == CHAN.wait_want) {
+				CHAN.wait_fn = NULL;
+				fn();
+			} else if (jiffies >= CHAN.deadline) {
+				CHAN.wait_fn = NULL;
+				hd_times_out();
+			}
+		} else if (do_hd[hd_chan] && jiffies >= CHAN.deadline) {
+			hd_times_out();
+		}
+	}
+	hd_chan = old;
+}
+
 void unexpected_hd_int(void) {
 	printk("Unexpected hd interrupt\n\r");
 }
 
+/* called by hd_int and hd2_int with the channel that raised IRQ 14 or 15 */
+void hd_interrupt(int chan) {
+	int old = hd_chan;
+	void (*intr)(void);
+	
+	hd_chan = chan;
+	if ((intr = do_hd[chan]))
+		do_hd[chan] = NULL;
+	else
+		intr = &unexpected_hd_int;
+	intr();
+	hd_chan = old;
+}
+
 static void bad_rw_int(void) {
+	/* and to PIO if DMA does */
+	if (hd_info[CURRENT_DEV].dma && CURRENT->errors >= MAX_ERRORS / 2) {
+		printk("hd%d: DMA failing, using PIO\n\r", CURRENT_DEV);
+		hd_info[CURRENT_DEV].dma = 0;
+	}
+	/* fall back to one sector per interrupt if the block commands keep failing */
+	if (hd_info[CURRENT_DEV].mult && CURRENT->errors >= MAX_ERRORS / 2) {
+		printk("hd%d: READ/WRITE MULTIPLE failing, using single sectors\n\r", CURRENT_DEV);
+		hd_info[CURRENT_DEV].mult = 0;
+	}
 	if (++CURRENT->errors >= MAX_ERRORS)
 		end_request(0);
 	if (CURRENT->error > MAX_ERRORS / 2)
-		reset = 1;
+		CHAN.reset = 1;
 }
 
 static void read_int(void) {
+	int n;
+	
 	if (win_result()) {
 		bad_rw_int();
 		do_hd_request();
 		return;
 	}
-	port_read(HD_DATA, CURRENT->buffer, 256);	/* 256 words = 512 bytes = a sector */
+	n = (CURRENT->nr_sect < CHAN.cur_mult)? CURRENT->nr_sect: CHAN.cur_mult;
+	while (n-- > 0) {
+		port_read(HD_IO(HD_DATA), CURRENT->buffer, 256);	/* 256 words = 512 bytes = a sector */
+		advance_request(1);
+	}
 	CURRENT->errors = 0;
-	CURRENT->buffer += 512;
-	CURRENT->sector++;
-	if (--CURRENT->nr_sect) {
-		do_hd = &read_int;
+	if (CURRENT->nr_sect) {
+		SET_INTR(&read_int);
 		return;
 	}
 	end_request(1);
 	do_hd_request();
 }
 
+/* 
+ * write the next block of up to 'cur_mult' sectors. the request moves on 
+ * before each sector goes out, from hd_wait() interrupts are on and 
+ * write_int() may come as soon as the last word is written.
+ */
+static void write_block(void) {
+	int n = (CURRENT->nr_sect < CHAN.cur_mult)? CURRENT->nr_sect: CHAN.cur_mult;
+	char *buf;
+	
+	CHAN.wr_sector = CURRENT->sector;
+	CHAN.wr_nr_sect = CURRENT->nr_sect;
+	CHAN.wr_buffer = CURRENT->buffer;
+	CHAN.wr_bh = CURRENT->cur_bh;
+	while (n-- > 0) {
+		buf = CURRENT->buffer;
+		advance_request(1);
+		port_write(HD_IO(HD_DATA), buf, 256);
+	}
+}
+
+/* 
+ * the data of a write is out. a REQ_FUA the drive has no FUA command for 
+ * is only done once FLUSH CACHE has followed it, hd_start() sends that.
+ */
+static void write_done(void) {
+	if (CHAN.fua_flush) {
+		CHAN.fua_flush = 0;
+		CURRENT->flags |= REQ_WRITTEN;
+		CURRENT->errors = 0;
+	} else
+		end_request(1);
+	do_hd_request();
+}
+
 static void write_int(void) {
 	if (win_result()) {
+		CURRENT->sector = CHAN.wr_sector;
+		CURRENT->nr_sect = CHAN.wr_nr_sect;
+		CURRENT->buffer = CHAN.wr_buffer;
+		CURRENT->cur_bh = CHAN.wr_bh;
 		bad_rw_int();
 		do_hd_request();
 		return;
 	}
-	if (--CURRENT->nr_sect) {
-		CURRENT->sector++;
-		CURRENT->buffer += 512;
-		do_hd = &write_int;
-		port_write(HD_DATA, CURRENT->buffer, 256);
+	if (CURRENT->nr_sect) {
+		SET_INTR(&write_int);
+		write_block();
 		return;
 	}
-	end_request(1);
-	do_hd_request();
+	write_done();
+}
+
+/* the whole request has been moved by the bus master */
+static void dma_int(void) {
+	int bm_stat;
+	
+	outb_p(0x00, CHAN.bm_base + BM_COMMAND);		/* stop */
+	bm_stat = inb_p(CHAN.bm_base + BM_STATUS);
+	outb_p(0x06, CHAN.bm_base + BM_STATUS);
+	if (win_result() || (bm_stat & 0x02)) {
+		bad_rw_int();
+		do_hd_request();
+		return;
+	}
+	CURRENT->errors = 0;
+	if (CURRENT->cmd == WRITE)
+		write_done();
+	else {
+		end_request(1);
+		do_hd_request();
+	}
 }
 
 static void recal_int(void) {
@@ -245,62 +646,142 @@ static void recal_int(void) {
 	do_hd_request();
 }
 
+/* a REQ_FLUSH, every write before it is on the disk now */
+static void flush_int(void) {
+	if (win_result()) {
+		bad_rw_int();
+		do_hd_request();
+		return;
+	}
+	end_request(1);
+	do_hd_request();
+}
+
+/* 
+ * commands are only sent once the controller is ready, that wait is done 
+ * by hd_wait(). a reset goes ahead, the controller may be stuck.
+ */
 void do_hd_request(void) {
-	int i, r;
-	unsigned int blk, dev;
+	if (!CURRENT || CHAN.wait_fn) return;
+	if (CHAN.reset)
+		hd_start();
+	else
+		hd_wait(BUSY_STAT | READY_STAT, READY_STAT, &hd_start);
+}
+
+static void hd_start(void) {
+	unsigned long blk;
+	unsigned int dev, cmd;
 	unsigned int sector, head, cylind;
 	unsigned int nr_sect;
+	void (*intr)(void);
 	
 	INIT_REQUEST;
 	dev = MINOR(CURRENT->dev);
 	blk = CURRENT->sector;
-	if (dev >= NR_HD * 5 || blk > hd[dev].nr_sect - 2)) {
+	if (dev >= 10 || blk + CURRENT->nr_sect > hd[dev + 10 * hd_chan].nr_sect) {
 		end_request(0);
 		goto loop;		/* blk.h (line 91) */
 	}
 	
-	blk += hd[dev].start_sect;		/* absolute sector nr */
-	dev /= 5;		/* hd nr */
-	__asm__("divl %4"
-		: "=a"(blk), "=d"(sector)
-		: ""(blk), "1"(0), "r"(hd_info[dev].sector));
-	__asm__("divl %4"
-		: "=a"(cylind), "=d"(head)
-		: ""(blk), "1"(0), "r"(hd_info[dev].head));
-	sector++;
+	blk += hd[dev + 10 * hd_chan].start_sect;		/* absolute sector nr */
+	dev = HD_DRIVE(hd_chan, dev / 5);		/* hd nr */
 	nr_sect = CURRENT->nr_sect;
-	if (reset) {
-		reset = 0;
-		recal_flag = 1;
-		reset_hd(CURRENT_DEV);
+	if (CHAN.reset) {
+		CHAN.reset = 0;
+		CHAN.recal_flag = 1;
+		reset_hd();
 		return;
 	}
-	if (recal_flag) {
-		recal_flag = 0;
-		hd_out(dev, hd_info[CURRENT_DEV].sector, 
+	if (CHAN.recal_flag) {
+		CHAN.recal_flag = 0;
+		hd_out(dev, hd_info[dev].sector, 
 			0, 0, 0, WIN_RESTORE, &recal_int);
 		return;
 	}
 	
-	if (CURRENT->cmd == WRITE) {
-		hd_out(dev, nr_sect, sector, head, cylind, WIN_WRITE, &write_int);
-		
-		for (i = 0; i < 3000; !(r = inb_p(HD_STATUS) & DRQ_STAT); ++i) continue;
-		if (!r) {
-			bad_rw_int();
+	/* a REQ_FLUSH, or what is left of a REQ_FUA, see write_done() */
+	if (CURRENT->flags & (REQ_FLUSH | REQ_WRITTEN)) {
+		if (!hd_info[dev].flush) {
+			end_request(1);
 			goto loop;
 		}
-		port_write(HD_DATA, CURRENT->buffer, 256);
-	} else if (CURRENT->cmd = READ) {
-		hd_out(dev, nr_sect, sector, head, cylind, WIN_READ, &read_int);
+		hd_out(dev, 0, 0, 0, 0, hd_info[dev].flush, &flush_int);
+		CHAN.deadline = jiffies + HD_FLUSH_TIMEOUT;
+		return;
+	}
+	
+	CHAN.cur_mult = hd_info[dev].mult? hd_info[dev].mult: 1;
+	if (hd_info[dev].dma) {
+		bm_setup();
+		cmd = (CURRENT->cmd == READ)? WIN_READ_DMA: WIN_WRITE_DMA;
+		intr = &dma_int;
+	} else if (CURRENT->cmd == WRITE) {
+		cmd = hd_info[dev].mult? WIN_MULTWRITE: WIN_WRITE;
+		intr = &write_int;
+	} else if (CURRENT->cmd == READ) {
+		cmd = hd_info[dev].mult? WIN_MULTREAD: WIN_READ;
+		intr = &read_int;
 	} else {
 		panic("Unknown hd command");
 	}
+	/* FUA goes with DMA or MULTIPLE, there is no single sector form, FLUSH CACHE then */
+	if ((CURRENT->flags & REQ_FUA) && hd_info[dev].fua) {
+		if (cmd == WIN_WRITE_DMA)
+			cmd = WIN_WRITE_DMA_FUA_EXT;
+		else if (cmd == WIN_MULTWRITE)
+			cmd = WIN_MULTWRITE_FUA_EXT;
+	}
+	CHAN.fua_flush = (CURRENT->flags & REQ_FUA) && hd_info[dev].flush
+		&& cmd != WIN_WRITE_DMA_FUA_EXT && cmd != WIN_MULTWRITE_FUA_EXT;
+	
+	if (hd_info[dev].lba) {
+		hd_out_lba(dev, nr_sect, blk, cmd, intr);
+	} else {
+		__asm__("divl %4"
+			: "=a"(blk), "=d"(sector)
+			: ""(blk), "1"(0), "r"(hd_info[dev].sector));
+		__asm__("divl %4"
+			: "=a"(cylind), "=d"(head)
+			: ""(blk), "1"(0), "r"(hd_info[dev].head));
+		sector++;
+		hd_out(dev, nr_sect, sector, head, cylind, cmd, intr);
+	}
+	
+	if (hd_info[dev].dma) {
+		outb_p(inb_p(CHAN.bm_base + BM_COMMAND) | 0x01, CHAN.bm_base + BM_COMMAND);	/* start */
+	} else if (CURRENT->cmd == WRITE) {
+		hd_wait(BUSY_STAT | DRQ_STAT, DRQ_STAT, &write_block);
+	}
+}
+
+/* the queues of the two channels are served independently */
+static void do_hd0_request(void) {
+	hd_chan = 0;
+	do_hd_request();
+}
+
+static void do_hd1_request(void) {
+	hd_chan = 1;
+	do_hd_request();
+}
+
+/* blocks of a partition, for read-ahead */
+static unsigned long hd_nr_blk(int dev) {
+	int minor = MINOR(dev);
+	
+	if (minor >= 10) return 0;
+	return hd[minor + (MAJOR(dev) == HD2_MAJOR? 10: 0)].nr_sect >> 1;
 }
 
 void hd_init(void) {
-	blk_dev[MAJOR_NR].request_func = DEVICE_REQUEST;
+	blk_dev[MAJOR_NR].request_func = &do_hd0_request;
+	blk_dev[HD2_MAJOR].request_func = &do_hd1_request;
+	blk_dev[MAJOR_NR].nr_blk = blk_dev[HD2_MAJOR].nr_blk = &hd_nr_blk;
+	blk_dev[MAJOR_NR].flush = blk_dev[HD2_MAJOR].flush = 1;
+	bm_probe();
 	set_int_gate(0x2e, &hd_int);
+	set_int_gate(0x2f, &hd2_int);
 	outb_p(inb_p(0x21) & 0xfb, 0x21);	/* master 8259A, IRQ2 allowed */
-	outb(inb_p(0xa1) & 0xbf, 0xa1);		/* slave 8259A, IRQ14 (hd) allowed */
+	outb(inb_p(0xa1) & 0x3f, 0xa1);		/* slave 8259A, IRQ14 and IRQ15 (hd) allowed */
 }
\ No newline at end of file
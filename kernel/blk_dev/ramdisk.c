@@ -0,0 +1,133 @@
+/*
+ * Mirix 1.0/kernel/blk_dev/ramdisk.c
+ * (C) 2022 Miris Lee
+ */
+
+#include <string.h>
+#include <mirix/config.h>
+#include <mirix/sched.h>
+#include <mirix/fs.h>
+#include <mirix/kernel.h>
+#include <asm/system.h>
+#include <asm/segment.h>
+
+#define MAJOR_NR	1	/* ram disk */
+#include "blk.h"
+
+/* the image follows the kernel on the boot floppy, the size is at 0x1fa of bootsect */
+#define RD_IMAGE_BLOCK	256
+#define RD_MINOR		1		/* /dev/ram -- 0x0101 */
+#define RD_MAX			(4*1024*1024)	/* largest ram disk */
+#define RD_KEEP			(512*1024)		/* main memory left at least */
+
+char *rd_start = NULL;
+long rd_length = 0;
+static long rd_asked = 0;		/* what the boot floppy asked for, if clamped */
+
+/* requests are done at once with memory copies, there is no interrupt */
+void do_rd_request(void) {
+	char *addr;
+	unsigned long n;
+
+	INIT_REQUEST;
+	addr = rd_start + (CURRENT->sector << 9);
+	if (MINOR(CURRENT->dev) != RD_MINOR
+		|| addr + (CURRENT->nr_sect << 9) > rd_start + rd_length) {
+		end_request(0);
+		goto loop;
+	}
+	while (CURRENT->nr_sect) {
+		/* up to the end of the buffer, nr_bh = 0 buffers are contiguous */
+		n = CURRENT->nr_sect;
+		if (CURRENT->nr_bh && n >
+			(CURRENT->bh[CURRENT->cur_bh]->b_data + BLOCK_SIZE - CURRENT->buffer) >> 9)
+			n = (CURRENT->bh[CURRENT->cur_bh]->b_data + BLOCK_SIZE - CURRENT->buffer) >> 9;
+		if (CURRENT->cmd == READ)
+			memcpy(CURRENT->buffer, addr, n << 9);
+		else if (CURRENT->cmd == WRITE)
+			memcpy(addr, CURRENT->buffer, n << 9);
+		else
+			panic("do_rd_request: unknown command");
+		addr += n << 9;
+		advance_request(n);
+	}
+	end_request(1);
+	goto loop;
+}
+
+/* blocks of the ram disk, for read-ahead */
+static unsigned long rd_nr_blk(int dev) {
+	return (MINOR(dev) == RD_MINOR)? rd_length >> 10: 0;
+}
+
+/*
+ * take 'length' bytes at 'start' for the ram disk, returns what was taken.
+ * the size comes from the boot sector, so it is capped to RD_MAX and to
+ * what leaves RD_KEEP below 'end'. the console is not up yet, rd_load()
+ * reports the clamp.
+ */
+long rd_init(long start, long length, long end) {
+	long max = end - start - RD_KEEP;
+
+	if (max > RD_MAX)
+		max = RD_MAX;
+	max &= 0xfffff000;				/* main memory starts on a page */
+	length = (length + 0xfff) & 0xfffff000;
+	if (length > max) {
+		rd_asked = length;
+		length = (max > 0)? max: 0;
+	}
+	if (!length) return 0;
+	blk_dev[MAJOR_NR].request_func = DEV_REQUEST;
+	blk_dev[MAJOR_NR].nr_blk = &rd_nr_blk;
+	rd_start = (char *)start;
+	rd_length = length;
+	memset(rd_start, 0, length);
+	return length;
+}
+
+/*
+ * called by sys_setup() before the root is mounted. if the root device is
+ * the floppy and a minix image follows the kernel on it, the image is
+ * copied into the ram disk and the root moves there.
+ */
+void rd_load(void) {
+	struct buffer_head *bh;
+	struct d_super_block s;
+	int block = RD_IMAGE_BLOCK;
+	int i = 1, nblocks;
+	char *cp;
+
+	if (rd_asked)
+		printk("Ram disk: %d bytes asked, clamped to %d\n\r", rd_asked, rd_length);
+	if (!rd_length) return;
+	printk("Ram disk: %d bytes, starting at 0x%x\n\r", rd_length, (int)rd_start);
+	if (MAJOR(ROOT_DEV) != 2) return;
+
+	if (!(bh = bread(ROOT_DEV, block + 1))) {	/* super block */
+		printk("Disk error while looking for ram disk\n\r");
+		return;
+	}
+	s = *(struct d_super_block *)bh->b_data;
+	brelse(bh);
+	if (s.s_magic != SUPER_MAGIC) return;		/* no image */
+	nblocks = s.s_nzones << s.s_log_zone_size;
+	if (nblocks > rd_length / BLOCK_SIZE) {
+		printk("Ram disk image too big (%d blocks, %d available)\n\r",
+			nblocks, rd_length / BLOCK_SIZE);
+		return;
+	}
+
+	printk("Loading %d bytes into ram disk... 0000k", nblocks * BLOCK_SIZE);
+	for (cp = rd_start; nblocks > 0; --nblocks, ++block, ++i, cp += BLOCK_SIZE) {
+		if (!(bh = bread(ROOT_DEV, block))) {	/* sequential, read ahead in rw_blk() */
+			printk("I/O error on block %d, aborting load\n\r", block);
+			return;
+		}
+		memcpy(cp, bh->b_data, BLOCK_SIZE);
+		brelse(bh);
+		printk("\010\010\010\010\010%4dk", i);
+	}
+	printk("\010\010\010\010\010done \n\r");
+	ROOT_DEV = 0x0100 | RD_MINOR;
+}
@@ -4,23 +4,103 @@
  */
 
 #include <errno.h>
+#include <string.h>
 #include <mirix/sched.h>
 #include <mirix/kernel.h>
 #include <asm/sytem.h>
+#include <asm/segment.h>
 #include "blk.h"
 
 struct request request[NR_REQUEST];
 
+/* free requests, linked by 'next' */
+static struct request *free_request = NULL;
+static int nr_free_request = 0;
+
+static struct blk_stat blk_stat[NR_BLK_DEV];
+extern unsigned long usec_clock(void);      /* kernel/sched.c */
+
 struct task_struct *wait_head = NULL;
 
+/* elevator order: by device, then by sector */
+#define IN_ORDER(s1,s2) \
+    ((s1)->dev < (s2)->dev || ((s1)->dev == (s2)->dev && (s1)->sector < (s2)->sector))
+
+#define READ_EXPIRE     (HZ / 2)
+#define WRITE_EXPIRE    (5 * HZ)
+#define AHEAD_EXPIRE    (5 * HZ)    /* read-ahead yields to demand reads */
+
+/* 
+ * sequential read detection, one stream per task and device. the window 
+ * doubles on each read that follows the stream and halves on each one 
+ * that does not, read-ahead stops at 0.
+ */
+#define NR_RA_STREAM    16
+#define RA_MIN          2           /* blocks */
+#define RA_MAX          (4 * MAX_MERGE)
+
+static struct ra_stream {
+    int dev;
+    struct task_struct *task;
+    unsigned long next;     /* block after the last demand read */
+    unsigned long ahead;    /* first block not read ahead yet */
+    int window;
+    long used;              /* jiffies, the oldest stream is reused */
+} ra_stream[NR_RA_STREAM];
+
+/* noop -- first come, first served */
+static void noop_add(struct request *head, struct request *req) {
+    for (; head->next; head = head->next) continue;
+    head->next = req;
+}
+
+static struct request *noop_next(struct request *head) {
+    return head->next;
+}
+
+/* C-LOOK -- sweep up in sector order, then jump back to the lowest */
+static void clook_add(struct request *head, struct request *req) {
+    for (; head->next; head = head->next) {
+        if ((IN_ORDER(head, req) || !IN_ORDER(head, head->next))
+            && IN_ORDER(req, head->next))
+            break;
+    }
+    req->next = head->next;
+    head->next = req;
+}
+
+/* deadline -- C-LOOK order, but the oldest expired request goes first */
+static struct request *deadline_next(struct request *head) {
+    struct request *req, *prev, *old = NULL, *old_prev = NULL;
+
+    for (prev = head, req = head->next; req; prev = req, req = req->next) {
+        if (req->deadline > jiffies) continue;
+        if (!old || req->deadline < old->deadline) {
+            old = req;
+            old_prev = prev;
+        }
+    }
+    if (!old || old_prev == head) return head->next;
+    old_prev->next = old->next;
+    old->next = head->next;
+    return old;
+}
+
+struct elevator elv_noop = { "noop", noop_add, noop_next };
+struct elevator elv_clook = { "c-look", clook_add, noop_next };
+struct elevator elv_deadline = { "deadline", clook_add, deadline_next };
+
+/* the queue depths are in blk.h, NR_REQUEST is their sum */
 struct blk_dev_struct blk_dev[NR_BLK_DEV] = {
-    { NULL, NULL },     /* 0 -- null */
-    { NULL, NULL },     /* 1 -- mem */
-    { NULL, NULL },     /* 2 -- floppy */
-    { NULL, NULL },     /* 3 -- hd */
-    { NULL, NULL },     /* 4 -- ttyx */
-    { NULL, NULL },     /* 5 -- tty */
-    { NULL, NULL },     /* 6 -- lp */
+    { NULL, NULL, &elv_noop, 0, 0, { 0, 0 } },                              /* 0 -- null */
+    { NULL, NULL, &elv_noop, 0, 0, { MEM_REQ, MEM_REQ } },                  /* 1 -- mem */
+    { NULL, NULL, &elv_clook, 0, 0, { FD_REQ, FD_REQ } },                   /* 2 -- floppy */
+    { NULL, NULL, &elv_deadline, 0, 0, { HD_READ_REQ, HD_WRITE_REQ } },     /* 3 -- hd */
+    { NULL, NULL, &elv_noop, 0, 0, { 0, 0 } },                              /* 4 -- ttyx */
+    { NULL, NULL, &elv_noop, 0, 0, { 0, 0 } },                              /* 5 -- tty */
+    { NULL, NULL, &elv_noop, 0, 0, { 0, 0 } },                              /* 6 -- lp */
+    { NULL, NULL, &elv_deadline, 0, 0, { HD_READ_REQ, HD_WRITE_REQ } },     /* 7 -- hd, secondary channel */
+    { NULL, NULL, &elv_noop, 0, 0, { VBLK_REQ, VBLK_REQ } },                /* 8 -- virtio-blk */
 };
 
 static inline void lock_buffer(struct buffer_head *head) {
@@ -41,28 +121,156 @@ static void add_request(struct blk_dev_struct *dev, struct request *req) {
     struct request *tmp;
 
     req->next = NULL;
+    if (req->ahead)
+        req->deadline = jiffies + AHEAD_EXPIRE;
+    else
+        req->deadline = jiffies + ((req->cmd == READ)? READ_EXPIRE: WRITE_EXPIRE);
     cli();
-    if (req->head) req->head->b_dirt = 0;
+    if (req->nr_bh) req->bh[0]->b_dirt = 0;
+    /* counted on every path, put_request() gives it back */
+    if (req->flags & REQ_FLUSH) dev->barrier++;
 
     if (!(tmp = dev->current_request)) {
         dev->current_request = req;
+        if (dev->plugged) {     /* started by unplug_blk_dev() */
+            dev->plug_idle = 1;
+            sti();
+            return;
+        }
+        start_request(req);
         sti();
         (dev->request_func)();
         return;
     }
-    /* add 'req' to the request queue */
-    /* TODO: optimize this with thw elevator algorithm */
-    for (; tmp->next; tmp = tmp->next) continue;
-    req->next = tmp->next;
-    tmp->next = req;
+    /* add 'req' to the request queue, nothing passes a flush */
+    if (dev->barrier)
+        noop_add(tmp, req);
+    else
+        (dev->elevator->add_request)(tmp, req);
     sti();
 }
 
+/* start the plugged idle queues before sleeping, or nothing might ever finish */
+static void kick_blk_devs(void) {
+    struct blk_dev_struct *dev;
+
+    for (dev = blk_dev; dev < blk_dev + NR_BLK_DEV; ++dev) {
+        cli();
+        if (!dev->plug_idle) {
+            sti();
+            continue;
+        }
+        dev->plug_idle = 0;
+        start_request(dev->current_request);
+        sti();
+        (dev->request_func)();
+    }
+}
+
+/* 
+ * add 'head' to a queued request of the same kind for the sectors right 
+ * before or after it. the request being served is left alone, and read- 
+ * ahead only goes with read-ahead, its errors are not reported. called 
+ * with interrupts off.
+ */
+static int merge_request(struct blk_dev_struct *dev, int cmd, int fua, int ahead, 
+    struct buffer_head *head) {
+    struct request *req;
+    unsigned long sector = head->b_nr_blk << 1;
+    int i;
+
+    if (!(req = dev->current_request)) return 0;
+    if (!dev->plug_idle) req = req->next;
+    for (; req; req = req->next) {
+        if (req->dev != head->b_dev || req->cmd != cmd) continue;
+        if (!req->nr_bh || req->nr_bh >= MAX_MERGE) continue;
+        if ((req->flags & REQ_FUA) != fua || req->ahead != ahead) continue;
+        if (req->sector + req->nr_sect == sector) {     /* back merge */
+            req->bh[req->nr_bh++] = head;
+        } else if (sector + 2 == req->sector) {         /* front merge */
+            for (i = req->nr_bh++; i > 0; --i) req->bh[i] = req->bh[i - 1];
+            req->bh[0] = head;
+            req->sector = sector;
+            req->buffer = head->b_data;
+        } else {
+            continue;
+        }
+        req->nr_sect += 2;
+        head->b_dirt = 0;
+        blk_stat[MAJOR(req->dev)].nr_merge[RW_NR(cmd)]++;
+        return 1;
+    }
+    return 0;
+}
+
+#define QUEUE_FULL(dev,rw) \
+    ((dev)->nr_req[rw] >= (dev)->max_req[rw] || !free_request)
+
+/* read-ahead only gets half of the queue and leaves a quarter of the pool */
+#define AHEAD_FULL(dev,rw) \
+    ((dev)->nr_req[rw] >= (dev)->max_req[rw] / 2 || nr_free_request < NR_REQUEST / 4)
+
+/* take a request from the pool for 'major', NULL if 'ahead' and it is full */
+static struct request *get_request(int major, int cmd, int ahead) {
+    struct blk_dev_struct *dev = blk_dev + major;
+    struct request *req;
+    int rw = RW_NR(cmd);
+
+    cli();
+    if (ahead && AHEAD_FULL(dev, rw)) {
+        sti();
+        return NULL;
+    }
+    while (QUEUE_FULL(dev, rw)) {
+        if (ahead) {
+            sti();
+            return NULL;
+        }
+        sti();
+        kick_blk_devs();
+        cli();
+        if (!QUEUE_FULL(dev, rw)) break;
+        if (dev->nr_req[rw] >= dev->max_req[rw])
+            sleep_on(dev->wait_req + rw);   /* only this queue is congested */
+        else
+            sleep_on(&wait_head);
+    }
+    req = free_request;
+    free_request = req->next;
+    nr_free_request--;
+    dev->nr_req[rw]++;
+    blk_stat[major].depth = dev->nr_req[0] + dev->nr_req[1];
+    if (blk_stat[major].depth > blk_stat[major].max_depth)
+        blk_stat[major].max_depth = blk_stat[major].depth;
+    sti();
+    return req;
+}
+
+/* give a finished request back to the pool, called from end_request() */
+void put_request(struct request *req) {
+    struct blk_dev_struct *dev = blk_dev + MAJOR(req->dev);
+    int rw = RW_NR(req->cmd);
+
+    req->next = free_request;
+    free_request = req;
+    nr_free_request++;
+    dev->nr_req[rw]--;
+    if (req->flags & REQ_FLUSH) dev->barrier--;
+    blk_stat[MAJOR(req->dev)].depth = dev->nr_req[0] + dev->nr_req[1];
+    req->dev = -1;
+    wake_up(dev->wait_req + rw);
+    wake_up(&wait_head);
+}
+
 /* make a requset and add it to the queue */
 static void make_request(int major, int cmd, struct buffer_head *head) {
     struct request *req;
-    int ahead;
+    int ahead, fua = 0;
 
+    if (cmd == WRITE_FUA) {
+        cmd = WRITE;
+        fua = blk_dev[major].flush? REQ_FUA: 0;
+    }
     if (ahead = (cmd == READA || cmd == WRITEA)) {
         if (head->b_lock) return;
         if (cmd == READA) 
@@ -72,33 +280,24 @@ static void make_request(int major, int cmd, struct buffer_head *head) {
     }
     if (cmd != READ && cmd != WRITE)
         panic("Bad blk_dev command (R/W/RA/WA)");
+    if (head->b_lock) kick_blk_devs();
     lock_buffer(head);
     if ((cmd == READ && head->b_update) || (cmd == WRITE && !head->b_dirt)) {
         unlock_buffer(head);
         return;
     }
-
-loop:
-    /* change the order of the requests in the queue */
-    if (cmd == READ)
-        req = request + NR_REQUEST;
-    else 
-        req = request + NR_REQUEST * 2 / 3;
-
-    while (--req >= request) {
-        if (req->dev == -1)     /* free */
-            break;
+    cli();
+    if (merge_request(blk_dev + major, cmd, fua, ahead && cmd == READ, head)) {
+        sti();
+        return;
     }
-    if (req < request) {    /* none is free */
-        if (ahead) {
-            unlock_buffer(head);
-            return;
-        }
-        sleep_on(&wait_head);
-        goto loop;
+    sti();
+
+    if (!(req = get_request(major, cmd, ahead))) {
+        unlock_buffer(head);
+        return;
     }
 
-    /* we have found a free entry so far */
     req->dev = head->b_dev;
     req->cmd = cmd;
     req->errors = 0;
@@ -106,26 +305,767 @@ loop:
     req->nr_sect = 2;
     req->buffer = head->b_data;
     req->waiting = NULL;
-    req->head = head;
+    req->bh[0] = head;
+    req->nr_bh = 1;
+    req->cur_bh = 0;
     req->next = NULL;
+    req->ahead = (ahead && cmd == READ);
+    req->queued = usec_clock();
+    req->dio = NULL;
+    req->flags = fua;
+    add_request(blk_dev + major, req);
+}
+
+/* 
+ * queue a cache flush of the drive of 'dev' behind every request queued 
+ * on it so far. with 'wait', sleep until it is done and return 0 or 
+ * -EIO. drivers without a write cache do not take them, their writes 
+ * are on the disk once done.
+ */
+int blk_flush(int dev, int wait) {
+    struct request *req;
+    struct dio dio;
+    int major = MAJOR(dev);
+
+    if (major >= NR_BLK_DEV || !blk_dev[major].flush) return 0;
+    req = get_request(major, WRITE, 0);
+    req->dev = dev;
+    req->cmd = WRITE;
+    req->errors = 0;
+    req->sector = 0;
+    req->nr_sect = 0;
+    req->buffer = NULL;
+    req->waiting = NULL;
+    req->nr_bh = 0;
+    req->cur_bh = 0;
+    req->ahead = 0;
+    req->queued = usec_clock();
+    req->dio = NULL;
+    req->flags = REQ_FLUSH;
+    if (!wait) {
+        add_request(blk_dev + major, req);
+        return 0;
+    }
+    dio.nr = 1;
+    dio.error = 0;
+    dio.wait = NULL;
+    dio.done = NULL;
+    dio.nr_pages = 0;
+    req->dio = &dio;
     add_request(blk_dev + major, req);
+    cli();
+    while (dio.nr) sleep_on(&dio.wait);
+    sti();
+    return dio.error? -EIO: 0;
+}
+
+static struct ra_stream *find_stream(int dev) {
+    struct ra_stream *s, *old = ra_stream;
+
+    for (s = ra_stream; s < ra_stream + NR_RA_STREAM; ++s) {
+        if (s->task == current && s->dev == dev) return s;
+        if (s->used < old->used) old = s;
+    }
+    old->dev = dev;
+    old->task = current;
+    old->next = old->ahead = 0;
+    old->window = 0;
+    return old;
+}
+
+/* 
+ * a demand read of 'head' missed the cache, adjust the window of its 
+ * stream and get the buffers after the ones read ahead already. getblk() 
+ * may sleep, so this is done before the queue is plugged.
+ */
+static int read_ahead(struct buffer_head *head, struct buffer_head *heads[]) {
+    struct ra_stream *s = find_stream(head->b_dev);
+    unsigned long (*nr_blk)(int dev) = blk_dev[MAJOR(head->b_dev)].nr_blk;
+    unsigned long blk = head->b_nr_blk, end, size;
+    int nr = 0;
+
+    if (s->next && blk >= s->next && blk <= s->ahead) {    /* sequential */
+        s->window = s->window? s->window << 1: RA_MIN;
+        if (s->window > RA_MAX) s->window = RA_MAX;
+    } else {
+        s->window >>= 1;
+        s->ahead = blk + 1;
+    }
+    s->next = blk + 1;
+    s->used = jiffies;
+    if (!s->window || !nr_blk) return 0;
+
+    if (s->ahead < blk + 1) s->ahead = blk + 1;
+    end = blk + 1 + s->window;
+    if (end > (size = nr_blk(head->b_dev))) end = size;     /* drivers fail it whole */
+    for (; s->ahead < end && nr < RA_MAX; ++s->ahead)
+        heads[nr++] = getblk(head->b_dev, s->ahead);
+    return nr;
+}
+
+extern struct task_struct *buffer_wait;     /* fs/buffer.c */
+
+/* brelse() without waiting for the buffer to be unlocked */
+static void put_buffer(struct buffer_head *bh) {
+    bh->b_count--;
+    wake_up(&buffer_wait);
 }
 
 void rw_blk(int cmd, struct buffer_head *head) {
+    struct buffer_head *heads[RA_MAX];
     unsigned int major;
+    int i, nr;
 
     if ((major = MAJOR(head->b_dev)) >= NR_BLK_DEV 
         || !(blk_dev[major].request_func)) {
         printk("Trying to read nonexisting blk_dev\n\r");
         return;
     }
+    if (cmd != READ) {
+        make_request(major, cmd, head);
+        return;
+    }
+    /* one plug, so the read-ahead merges with 'head' */
+    nr = read_ahead(head, heads);
+    plug_blk_dev(major);
     make_request(major, cmd, head);
+    for (i = 0; i < nr; ++i)
+        make_request(major, READA, heads[i]);
+    unplug_blk_dev(major);
+    for (i = 0; i < nr; ++i)
+        put_buffer(heads[i]);   /* not brelse(), that would wait for the read */
+}
+
+/* hold back dispatch on an idle queue so that a batch can be merged */
+void plug_blk_dev(int major) {
+    cli();
+    blk_dev[major].plugged++;
+    sti();
+}
+
+void unplug_blk_dev(int major) {
+    struct blk_dev_struct *dev = blk_dev + major;
+
+    cli();
+    if (--dev->plugged > 0 || !dev->plug_idle) {
+        sti();
+        return;
+    }
+    dev->plug_idle = 0;
+    start_request(dev->current_request);
+    sti();
+    (dev->request_func)();
+}
+
+static int lat_bucket(unsigned long t) {
+    int i;
+
+    for (i = 0; t && i < NR_LAT_BUCKET - 1; ++i) t >>= 1;
+    return i;
+}
+
+/* 'req' is handed to the driver */
+void start_request(struct request *req) {
+    req->started = usec_clock();
+    req->xfer_sect = req->nr_sect;
+}
+
+/* 'req' is done, called from end_request() */
+void account_request(struct request *req, int uptodate) {
+    struct blk_stat *s = blk_stat + MAJOR(req->dev);
+    int rw = RW_NR(req->cmd);
+    unsigned long wait = req->started - req->queued;
+    unsigned long serv = usec_clock() - req->started;
+
+    s->nr_req[rw]++;
+    s->nr_sect[rw] += req->xfer_sect;
+    if (!uptodate) s->nr_error[rw]++;
+    s->wait_time[rw] += wait;
+    s->serv_time[rw] += serv;
+    s->wait_hist[rw][lat_bucket(wait)]++;
+    s->serv_hist[rw][lat_bucket(serv)]++;
+}
+
+int sys_iostat(int major, struct blk_stat *buf) {
+    int i;
+
+    if (major < 0 || major >= NR_BLK_DEV) return -EINVAL;
+    verify_area(buf, sizeof(struct blk_stat));
+    for (i = 0; i < sizeof(struct blk_stat) / 4; ++i)
+        put_fs_long(((unsigned long *)(blk_stat + major))[i], i + (unsigned long *)buf);
+    return 0;
+}
+
+/* submit 'nr' blocks in one plug, NULL entries are skipped */
+void rw_blk_batch(int cmd, struct buffer_head *heads[], int nr) {
+    unsigned int major, plugged = 0;
+    int i;
+
+    for (i = 0; i < nr; ++i) {
+        if (!heads[i]) continue;
+        if ((major = MAJOR(heads[i]->b_dev)) >= NR_BLK_DEV 
+            || !(blk_dev[major].request_func)) {
+            printk("Trying to read nonexisting blk_dev\n\r");
+            continue;
+        }
+        if (!(plugged & (1 << major))) {
+            plugged |= 1 << major;
+            plug_blk_dev(major);
+        }
+        make_request(major, cmd, heads[i]);
+    }
+    for (major = 0; major < NR_BLK_DEV; ++major)
+        if (plugged & (1 << major)) unplug_blk_dev(major);
+}
+
+/* 
+ * fill the page at 'page' with the blocks nr[0] ~ nr[3] of 'dev', the 
+ * page-in path of do_no_page(). the blocks not cached go in one plug, 
+ * so the contiguous ones become one request, and the caller waits on 
+ * the last one first, which usually finishes the others too: one sleep 
+ * per page. cached blocks are copied without I/O, 0 blocks left alone. 
+ * the last block missed goes through read_ahead(), as in rw_blk(), so 
+ * the pages after it are read in behind the demand reads.
+ */
+void blk_read_page(unsigned long page, int dev, int nr[4]) {
+    struct buffer_head *heads[4], *miss[4], *ahead[RA_MAX];
+    int i, last = -1, nr_ahead = 0;
+
+    for (i = 0; i < 4; ++i) {
+        heads[i] = miss[i] = NULL;
+        if (!nr[i]) continue;
+        heads[i] = getblk(dev, nr[i]);
+        if (!heads[i]->b_update) miss[last = i] = heads[i];
+    }
+    if (last >= 0 && MAJOR(dev) < NR_BLK_DEV && blk_dev[MAJOR(dev)].request_func)
+        nr_ahead = read_ahead(miss[last], ahead);
+    rw_blk_batch(READ, miss, 4);
+    rw_blk_batch(READA, ahead, nr_ahead);
+    for (i = 0; i < nr_ahead; ++i)
+        put_buffer(ahead[i]);
+    for (i = 3; i >= 0; --i) {
+        if (!heads[i]) continue;
+        cli();
+        while (heads[i]->b_lock) sleep_on(&heads[i]->b_wait);
+        sti();
+        if (heads[i]->b_update)
+            memcpy((char *)page + i * BLOCK_SIZE, heads[i]->b_data, BLOCK_SIZE);
+        brelse(heads[i]);
+    }
+}
+
+/* 
+ * direct I/O. the device transfers straight to or from the pages of the 
+ * user buffer, bypassing the buffer cache. each page is pinned and gets 
+ * a request of its own with nr_bh = 0, up to DIO_PAGES of them in one 
+ * plug. dirty cached blocks of the range are written first, and cached 
+ * blocks a direct write goes over are made stale.
+ */
+extern unsigned long pin_user_page(unsigned long addr, int write);  /* mm/mm.c */
+extern void unpin_user_page(unsigned long page);                    /* mm/mm.c */
+extern struct buffer_head *start_buffer;    /* fs/buffer.c */
+
+static void dio_sync_cache(int cmd, int dev, unsigned long sector, unsigned long nr_sect) {
+    struct buffer_head *bh = start_buffer;
+    unsigned long first = sector >> 1, last = (sector + nr_sect - 1) >> 1;
+    int i;
+
+    for (i = 0; i < NR_BUFFERS; ++i, ++bh) {
+        if (bh->b_dev != dev || bh->b_nr_blk < first || bh->b_nr_blk > last) continue;
+        bh->b_count++;
+        if (bh->b_dirt) rw_blk(WRITE, bh);
+        cli();
+        while (bh->b_lock) sleep_on(&bh->b_wait);
+        sti();
+        if (cmd != READ) bh->b_update = 0;
+        put_buffer(bh);
+    }
+}
+
+/* can 'count' bytes at 'buf' of the current task go to 'dev' directly */
+static int dio_check(int cmd, int dev, char *buf, unsigned long count) {
+    unsigned long limit = get_limit(0x17);
+
+    if (cmd != READ && cmd != WRITE && cmd != WRITE_FUA) return -EINVAL;
+    if (MAJOR(dev) >= NR_BLK_DEV || !blk_dev[MAJOR(dev)].request_func)
+        return -ENODEV;
+    if (((unsigned long)buf | count) & 511) return -EINVAL;
+    if ((unsigned long)buf >= limit || count > limit - (unsigned long)buf) return -EFAULT;
+    return 0;
+}
+
+/* 
+ * pin the pages of up to DIO_PAGES of the 'count' bytes at linear 'addr' 
+ * and queue a request for each one, returns the bytes queued. 'dio' 
+ * finishes once all of them are done, dio_release() unpins the pages.
+ */
+static unsigned long dio_submit(int cmd, int dev, unsigned long sector, 
+    unsigned long addr, unsigned long count, struct dio *dio) {
+    struct request *req;
+    unsigned long n;
+    int i, major = MAJOR(dev), flags = 0;
+
+    if (cmd == WRITE_FUA) {
+        cmd = WRITE;
+        flags = blk_dev[major].flush? REQ_FUA: 0;
+    }
+    /* pin first, faulting the pages in may sleep */
+    for (dio->nr_pages = 0, n = 0; dio->nr_pages < DIO_PAGES && n < count; ++dio->nr_pages) {
+        if (!(dio->pages[dio->nr_pages] = pin_user_page(addr + n, cmd == READ))) break;
+        n += 4096 - ((addr + n) & 0xfff);
+    }
+    dio->nr = dio->nr_pages;
+    dio->error = 0;
+    dio->bytes = (n < count)? n: count;
+    if (!dio->nr_pages) return 0;
+    plug_blk_dev(major);
+    for (i = 0, n = 0; i < dio->nr_pages; ++i) {
+        req = get_request(major, cmd, 0);
+        req->dev = dev;
+        req->cmd = cmd;
+        req->errors = 0;
+        req->sector = sector + (n >> 9);
+        req->nr_sect = 4096 - ((addr + n) & 0xfff);
+        if (req->nr_sect > count - n) req->nr_sect = count - n;
+        req->buffer = (char *)(dio->pages[i] + ((addr + n) & 0xfff));
+        n += req->nr_sect;
+        req->nr_sect >>= 9;
+        req->waiting = NULL;
+        req->nr_bh = 0;
+        req->cur_bh = 0;
+        req->ahead = 0;
+        req->queued = usec_clock();
+        req->dio = dio;
+        req->flags = flags;
+        add_request(blk_dev + major, req);
+    }
+    unplug_blk_dev(major);
+    return dio->bytes;
+}
+
+static void dio_release(struct dio *dio) {
+    while (dio->nr_pages > 0) unpin_user_page(dio->pages[--dio->nr_pages]);
+}
+
+/* 
+ * 'cmd' READ or WRITE of args->count bytes at args->sector of 'dev', 
+ * returns the bytes done or an error. the caller sleeps until the 
+ * device is done with the pages.
+ */
+int sys_dio(int cmd, int dev, struct dio_args *args) {
+    struct dio dio;
+    unsigned long sector, count, addr, n, done = 0;
+    char *buf;
+    int error;
+
+    if (!suser()) return -EPERM;      /* raw device, no file permissions */
+    sector = get_fs_long(&args->sector);
+    buf = (char *)get_fs_long((unsigned long *)&args->buf);
+    count = get_fs_long(&args->count);
+    if ((error = dio_check(cmd, dev, buf, count))) return error;
+    if (!count) return 0;
+    dio_sync_cache(cmd, dev, sector, count >> 9);
+
+    dio.error = 0;
+    dio.wait = NULL;
+    dio.done = NULL;
+    addr = get_base(current->ldt[2]) + (unsigned long)buf;
+    while (count) {
+        if (!(n = dio_submit(cmd, dev, sector, addr, count, &dio))) break;
+        cli();
+        while (dio.nr) sleep_on(&dio.wait);
+        sti();
+        dio_release(&dio);
+        if (dio.error) break;
+        sector += n >> 9;
+        addr += n;
+        count -= n;
+        done += n;
+    }
+    if (cmd != READ && done)    /* blocks read into the cache meanwhile */
+        dio_sync_cache(WRITE, dev, get_fs_long(&args->sector), done >> 9);
+    if (!done && dio.error) return -EIO;
+    return done? done: -EFAULT;
+}
+
+/* 
+ * asynchronous direct I/O. a task sets up a page of its memory as a 
+ * struct aio_ring, queues transfers on the submission ring and finds 
+ * the results on the completion ring. the page is pinned and the kernel 
+ * uses it through its physical address, so completions are posted from 
+ * finish_request() and the task is only woken once as many as it waits 
+ * for are there. each transfer is one dio of up to DIO_PAGES pages, a 
+ * longer one completes short. the ring does not follow the task through 
+ * fork(), which would make the page copy-on-write.
+ */
+#define NR_AIO_CTX      8
+#define AIO_OPS         32          /* transfers in flight per ring */
+
+struct aio_op {
+    struct dio dio;                 /* first, the completion casts back */
+    struct aio_ctx *ctx;
+    unsigned long user_data;
+    int state;                      /* AIO_FREE, AIO_BUSY or AIO_DONE */
+    int cmd, dev;
+    unsigned long sector;
+};
+
+#define AIO_FREE        0
+#define AIO_BUSY        1
+#define AIO_DONE        2           /* posted, pages not unpinned yet */
+
+static struct aio_ctx {
+    struct task_struct *owner;      /* NULL -- free */
+    long pid;                       /* of the owner, its slot may be reused */
+    struct aio_ring *ring;          /* physical */
+    unsigned long page;
+    int inflight, want;
+    struct task_struct *wait;
+    struct aio_op ops[AIO_OPS];
+} aio_ctx[NR_AIO_CTX];
+
+/* called from finish_request() once all the requests of a transfer are done */
+static void aio_complete(struct dio *dio) {
+    struct aio_op *op = (struct aio_op *)dio;
+    struct aio_ctx *ctx = op->ctx;
+    struct aio_ring *ring = ctx->ring;
+    struct aio_cqe *cqe;
+
+    if (ring->cq_tail - ring->cq_head >= AIO_CQ_ENTRIES) {
+        ring->cq_overflow++;
+    } else {
+        cqe = ring->cq + ring->cq_tail % AIO_CQ_ENTRIES;
+        cqe->user_data = op->user_data;
+        cqe->res = dio->error? -EIO: dio->bytes;
+        ring->cq_tail++;
+    }
+    op->state = AIO_DONE;
+    ctx->inflight--;
+    if (ctx->wait && (!ctx->inflight || ring->cq_tail - ring->cq_head >= ctx->want))
+        wake_up(&ctx->wait);
+}
+
+/* post a completion for a transfer that was never queued */
+static void aio_post(struct aio_ctx *ctx, unsigned long user_data, long res) {
+    struct aio_ring *ring = ctx->ring;
+    struct aio_cqe *cqe;
+
+    cli();
+    if (ring->cq_tail - ring->cq_head >= AIO_CQ_ENTRIES) {
+        ring->cq_overflow++;
+    } else {
+        cqe = ring->cq + ring->cq_tail % AIO_CQ_ENTRIES;
+        cqe->user_data = user_data;
+        cqe->res = res;
+        ring->cq_tail++;
+    }
+    sti();
+}
+
+/* 
+ * unpin the pages of the posted transfers, and make stale the blocks a 
+ * write went over that were read into the cache while it was queued.
+ */
+static void aio_reap(struct aio_ctx *ctx) {
+    struct aio_op *op;
+
+    for (op = ctx->ops; op < ctx->ops + AIO_OPS; ++op) {
+        if (op->state != AIO_DONE) continue;
+        if (op->cmd != READ && !op->dio.error)
+            dio_sync_cache(WRITE, op->dev, op->sector, op->dio.bytes >> 9);
+        dio_release(&op->dio);
+        op->state = AIO_FREE;
+    }
+}
+
+static struct aio_ctx *aio_find(struct task_struct *p) {
+    struct aio_ctx *ctx;
+
+    for (ctx = aio_ctx; ctx < aio_ctx + NR_AIO_CTX; ++ctx)
+        if (ctx->owner == p && ctx->pid == p->pid) return ctx;
+    return NULL;
+}
+
+/* queue the submissions, as long as there are free ops and room to post */
+static int aio_submit(struct aio_ctx *ctx) {
+    struct aio_ring *ring = ctx->ring;
+    struct aio_sqe sqe;
+    struct aio_op *op;
+    long res;
+    int nr = 0;
+
+    while (ring->sq_head != ring->sq_tail) {
+        if (ctx->inflight + ring->cq_tail - ring->cq_head >= AIO_CQ_ENTRIES) break;
+        for (op = ctx->ops; op < ctx->ops + AIO_OPS && op->state != AIO_FREE; ++op) continue;
+        if (op >= ctx->ops + AIO_OPS) break;
+        sqe = ring->sq[ring->sq_head % AIO_SQ_ENTRIES];
+        ring->sq_head++;
+        nr++;
+        if ((res = dio_check(sqe.cmd, sqe.dev, sqe.buf, sqe.count)) || !sqe.count) {
+            aio_post(ctx, sqe.user_data, res);
+            continue;
+        }
+        dio_sync_cache(sqe.cmd, sqe.dev, sqe.sector, sqe.count >> 9);
+        op->ctx = ctx;
+        op->user_data = sqe.user_data;
+        op->cmd = sqe.cmd;
+        op->dev = sqe.dev;
+        op->sector = sqe.sector;
+        op->dio.wait = NULL;
+        op->dio.done = aio_complete;
+        op->state = AIO_BUSY;
+        cli();
+        ctx->inflight++;
+        sti();
+        if (!dio_submit(sqe.cmd, sqe.dev, sqe.sector, 
+            get_base(current->ldt[2]) + (unsigned long)sqe.buf, sqe.count, &op->dio)) {
+            cli();
+            ctx->inflight--;
+            op->state = AIO_FREE;
+            sti();
+            aio_post(ctx, sqe.user_data, -EFAULT);
+        }
+    }
+    return nr;
+}
+
+/* 
+ * AIO_SETUP -- 'arg' is the page-aligned struct aio_ring, zeroed. 
+ * AIO_ENTER -- queue the submissions, then wait until 'arg' completions 
+ *              are on the ring or nothing is in flight. returns the 
+ *              submissions taken. 
+ * AIO_EXIT  -- wait for the transfers in flight and drop the ring.
+ */
+int sys_aio(int cmd, unsigned long arg) {
+    struct aio_ctx *ctx;
+    struct aio_ring *ring;
+    int nr;
+
+    if (!suser()) return -EPERM;      /* raw devices, as sys_dio() */
+    ctx = aio_find(current);
+    switch (cmd) {
+        case AIO_SETUP:
+            if (ctx) return -EBUSY;
+            if ((arg & 0xfff) || arg + 4096 > get_limit(0x17)) return -EINVAL;
+            for (ctx = aio_ctx; ctx < aio_ctx + NR_AIO_CTX; ++ctx) {
+                /* the owner may have exited, there is no exit hook */
+                if (ctx->owner && !ctx->inflight) {
+                    for (nr = 0; nr < NR_TASKS; ++nr)
+                        if (task[nr] == ctx->owner && task[nr]->pid == ctx->pid) break;
+                    if (nr >= NR_TASKS) {
+                        aio_reap(ctx);
+                        unpin_user_page(ctx->page);
+                        ctx->owner = NULL;
+                    }
+                }
+                if (!ctx->owner) break;
+            }
+            if (ctx >= aio_ctx + NR_AIO_CTX) return -EAGAIN;
+            if (!(ctx->page = pin_user_page(get_base(current->ldt[2]) + arg, 1)))
+                return -EFAULT;
+            ctx->owner = current;
+            ctx->pid = current->pid;
+            ctx->ring = (struct aio_ring *)ctx->page;
+            ctx->inflight = 0;
+            ctx->wait = NULL;
+            for (nr = 0; nr < AIO_OPS; ++nr) ctx->ops[nr].state = AIO_FREE;
+            return 0;
+        case AIO_ENTER:
+            if (!ctx) return -EINVAL;
+            aio_reap(ctx);
+            nr = aio_submit(ctx);
+            ring = ctx->ring;
+            cli();
+            ctx->want = (arg > AIO_CQ_ENTRIES)? AIO_CQ_ENTRIES: arg;
+            while (ctx->inflight && ring->cq_tail - ring->cq_head < ctx->want)
+                sleep_on(&ctx->wait);
+            sti();
+            aio_reap(ctx);
+            return nr;
+        case AIO_EXIT:
+            if (!ctx) return -EINVAL;
+            cli();
+            ctx->want = AIO_CQ_ENTRIES + 1;
+            while (ctx->inflight) sleep_on(&ctx->wait);
+            sti();
+            aio_reap(ctx);
+            unpin_user_page(ctx->page);
+            ctx->owner = NULL;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+/* 
+ * write-back. the bdflush task sleeps in sys_bdflush() and wakes every 
+ * WB_INTERVAL. it writes the buffers dirty for longer than WB_AGE, or 
+ * the oldest ones while over WB_SOFT of the cache, in batches sorted by 
+ * block so they merge. writers are not throttled, buffers are made dirty 
+ * in fs/ and nothing there waits for it. each round ends with a cache 
+ * flush of the devices written, so that data older than WB_AGE + 
+ * WB_INTERVAL is on the disk even with the write cache on.
+ */
+#define WB_INTERVAL     (5 * HZ)
+#define WB_AGE          (10 * HZ)
+#define WB_BATCH        64
+#define WB_SOFT(n)      ((n) / 4)
+#define MAX_BUFFERS     4096        /* 4MB of buffer memory, init/main.c */
+
+static long dirty_since[MAX_BUFFERS];   /* jiffies, 0 -- clean when last seen */
+static int nr_dirty = 0;
+static long dirty_counted = -1;         /* jiffies of the last count */
+static struct task_struct *wb_task = NULL;
+static struct task_struct *wb_sleep = NULL;
+static int wb_timer_on = 0;
+
+#define NR_WB_DEV       8
+static int wb_dev[NR_WB_DEV], nr_wb_dev = 0;   /* written this round */
+
+/* count the dirty buffers and note when each one was first seen dirty */
+static int count_dirty(void) {
+    struct buffer_head *bh = start_buffer;
+    int i, nr = 0;
+
+    if (dirty_counted == jiffies) return nr_dirty;
+    for (i = 0; i < NR_BUFFERS && i < MAX_BUFFERS; ++i, ++bh) {
+        if (!bh->b_dirt) {
+            dirty_since[i] = 0;
+            continue;
+        }
+        if (!dirty_since[i]) dirty_since[i] = jiffies? jiffies: 1;
+        nr++;
+    }
+    dirty_counted = jiffies;
+    return nr_dirty = nr;
+}
+
+#define BLK_BEFORE(a,b) \
+    ((a)->b_dev < (b)->b_dev || ((a)->b_dev == (b)->b_dev && (a)->b_nr_blk < (b)->b_nr_blk))
+
+/* write one batch, returns how many buffers were written */
+static int flush_dirty(int all) {
+    struct buffer_head *heads[WB_BATCH], *bh, *tmp;
+    long since[WB_BATCH], t;
+    int i, j, nr = 0;
+
+    count_dirty();
+    /* keep the WB_BATCH oldest, sorted by age */
+    for (i = 0, bh = start_buffer; i < NR_BUFFERS && i < MAX_BUFFERS; ++i, ++bh) {
+        if (!bh->b_dirt || bh->b_lock || !(t = dirty_since[i])) continue;
+        if (!all && jiffies - t < WB_AGE) continue;
+        if (nr == WB_BATCH && t >= since[nr - 1]) continue;
+        if (nr < WB_BATCH) nr++;
+        for (j = nr - 1; j > 0 && since[j - 1] > t; --j) {
+            since[j] = since[j - 1];
+            heads[j] = heads[j - 1];
+        }
+        since[j] = t;
+        heads[j] = bh;
+    }
+    if (!nr) return 0;
+
+    /* then by block, for the elevator and merging */
+    for (i = 1; i < nr; ++i) {
+        tmp = heads[i];
+        for (j = i; j > 0 && BLK_BEFORE(tmp, heads[j - 1]); --j)
+            heads[j] = heads[j - 1];
+        heads[j] = tmp;
+    }
+    for (i = 0; i < nr; ++i) {
+        heads[i]->b_count++;
+        for (j = 0; j < nr_wb_dev && wb_dev[j] != heads[i]->b_dev; ++j) continue;
+        if (j == nr_wb_dev && nr_wb_dev < NR_WB_DEV)
+            wb_dev[nr_wb_dev++] = heads[i]->b_dev;
+    }
+    rw_blk_batch(WRITE, heads, nr);
+    for (i = 0; i < nr; ++i) put_buffer(heads[i]);
+    dirty_counted = -1;
+    return nr;
+}
+
+static void wb_timer(void) {
+    wb_timer_on = 0;
+    wake_up(&wb_sleep);
+}
+
+/* the write-back task, started by init() and never returns */
+int sys_bdflush(void) {
+    if (!suser()) return -EPERM;
+    if (wb_task) return -EBUSY;
+    wb_task = current;
+    while (1) {
+        while (flush_dirty(count_dirty() >= WB_SOFT(NR_BUFFERS)))
+            dirty_counted = -1;
+        while (nr_wb_dev > 0) blk_flush(wb_dev[--nr_wb_dev], 0);
+        cli();
+        if (!wb_timer_on) {
+            wb_timer_on = 1;
+            add_timer(WB_INTERVAL, wb_timer);
+        }
+        sleep_on(&wb_sleep);
+        sti();
+    }
+}
+
+/* 
+ * buffers for ISA DMA, which only reaches the first 16MB and cannot cross 
+ * a 64K boundary. the pool is one aligned 64K piece of the kernel, below 
+ * 1MB, handed out in runs of DMA_CHUNK. drivers take theirs at init.
+ */
+#define DMA_POOL_SIZE   0x10000
+#define DMA_CHUNK       1024
+#define NR_DMA_CHUNK    (DMA_POOL_SIZE / DMA_CHUNK)
+
+static char dma_pool[DMA_POOL_SIZE] __attribute__((aligned(DMA_POOL_SIZE)));
+static unsigned char dma_run[NR_DMA_CHUNK];     /* chunks in the run starting here */
+
+char *dma_alloc(unsigned long size) {
+    int i, j, nr = (size + DMA_CHUNK - 1) / DMA_CHUNK;
+
+    if (!nr || nr > NR_DMA_CHUNK) return NULL;
+    for (i = 0; i + nr <= NR_DMA_CHUNK; i += j) {
+        for (j = 0; j < nr && !dma_run[i + j]; ++j) continue;
+        if (j == nr) {
+            dma_run[i] = nr;
+            for (j = 1; j < nr; ++j) dma_run[i + j] = 0xff;     /* inside a run */
+            return dma_pool + i * DMA_CHUNK;
+        }
+        j += (dma_run[i + j] == 0xff)? 1: dma_run[i + j];
+    }
+    return NULL;
+}
+
+void dma_free(char *buf) {
+    int i = (buf - dma_pool) / DMA_CHUNK, nr;
+
+    if (buf < dma_pool || i >= NR_DMA_CHUNK || dma_run[i] == 0xff) {
+        printk("dma_free: bad buffer\n\r");
+        return;
+    }
+    for (nr = dma_run[i]; nr > 0; --nr) dma_run[i++] = 0;
+}
+
+/* PCI configuration space of bus 0, mechanism #1 */
+unsigned long pci_read(int dev, int fn, int reg) {
+    unsigned long val;
+
+    __asm__("outl %%eax, %%dx"::"a"(0x80000000 | (dev << 11) | (fn << 8) | reg), "d"(0xcf8));
+    __asm__("inl %%dx, %%eax":"=a"(val):"d"(0xcfc));
+    return val;
+}
+
+void pci_write(int dev, int fn, int reg, unsigned long val) {
+    __asm__("outl %%eax, %%dx"::"a"(0x80000000 | (dev << 11) | (fn << 8) | reg), "d"(0xcf8));
+    __asm__("outl %%eax, %%dx"::"a"(val), "d"(0xcfc));
 }
 
 void blk_dev_init(void) {
     int i;
     for (i = 0; i < NR_REQUEST; ++i) {
         request[i].dev = -1;
-        request[i].next = NULL;
+        request[i].next = free_request;
+        free_request = request + i;
     }
+    nr_free_request = NR_REQUEST;
 }
\ No newline at end of file
@@ -0,0 +1,273 @@
+/*
+ * Mirix 1.0/kernel/blk_dev/virtio_blk.c
+ * (C) 2022 Miris Lee
+ */
+
+#include <mirix/sched.h>
+#include <mirix/fs.h>
+#include <mirix/kernel.h>
+#include <asm/system.h>
+#include <asm/io.h>
+
+#define MAJOR_NR	8	/* virtio-blk, VBLK_MAJOR */
+#include "blk.h"
+
+/* legacy virtio PCI transport, registers from BAR0 */
+#define VIRTIO_FEATURES		0x00
+#define VIRTIO_GUEST_FEATURES	0x04
+#define VIRTIO_QUEUE_PFN		0x08
+#define VIRTIO_QUEUE_SIZE		0x0c
+#define VIRTIO_QUEUE_SEL		0x0e
+#define VIRTIO_QUEUE_NOTIFY	0x10
+#define VIRTIO_STATUS		0x12
+#define VIRTIO_ISR			0x13
+#define VIRTIO_BLK_CAPACITY	0x14	/* 64-bit, in sectors */
+
+#define STATUS_ACK			1
+#define STATUS_DRIVER		2
+#define STATUS_DRIVER_OK	4
+#define STATUS_FAILED		128
+
+#define VIRTIO_BLK_T_IN		0	/* read */
+#define VIRTIO_BLK_T_OUT	1	/* write */
+
+#define VRING_DESC_F_NEXT	1
+#define VRING_DESC_F_WRITE	2	/* written by the device */
+
+#define outw_p(val,port) \
+	__asm__("outw %%ax, %%dx"::"a"((unsigned short)(val)), "d"(port))
+#define inw_p(port) ({ \
+	unsigned short _v; \
+	__asm__ volatile("inw %%dx, %%ax":"=a"(_v):"d"(port)); \
+	_v; \
+})
+#define outl_p(val,port) \
+	__asm__("outl %%eax, %%dx"::"a"((unsigned long)(val)), "d"(port))
+#define inl_p(port) ({ \
+	unsigned long _v; \
+	__asm__ volatile("inl %%dx, %%eax":"=a"(_v):"d"(port)); \
+	_v; \
+})
+#define barrier() __asm__ volatile("":::"memory")
+
+struct vring_desc {
+	unsigned long addr, addr_hi;	/* physical */
+	unsigned long len;
+	unsigned short flags, next;
+};
+
+struct vring_avail {
+	unsigned short flags, idx;
+	unsigned short ring[0];
+};
+
+struct vring_used {
+	unsigned short flags, idx;
+	struct {
+		unsigned long id, len;
+	} ring[0];
+};
+
+/*
+ * the virtqueue is static, the device gets its page frame nr. each slot
+ * is a request in flight and owns DESC_PER_SLOT descriptors: the header,
+ * one per buffer and the status byte.
+ */
+#define MAX_QUEUE_SIZE	256
+#define DESC_PER_SLOT	(MAX_MERGE + 2)
+#define NR_SLOT			16
+
+static char vring_area[4 * 4096] __attribute__((aligned(4096)));
+static struct vring_desc *desc;
+static struct vring_avail *avail;
+static volatile struct vring_used *used;
+static unsigned short queue_size = 0, last_used = 0;
+
+static struct vblk_slot {
+	struct request *req;	/* NULL -- free */
+	struct {
+		unsigned long type, ioprio;
+		unsigned long sector, sector_hi;
+	} hdr;
+	volatile unsigned char status;	/* 0 -- ok */
+} slot[NR_SLOT];
+static int nr_slot = 0;
+
+static unsigned short io_base = 0;	/* 0 -- no device */
+static int vblk_irq = 0;
+static unsigned long capacity = 0;	/* sectors */
+
+extern void virtio_blk_int(void);	/* kernel/syscall.asm */
+
+/* put 'req' on the avail ring, 0 if every slot is in flight */
+static int submit(struct request *req) {
+	struct vblk_slot *s;
+	struct vring_desc *d;
+	int i, first, wr;
+
+	for (i = 0; i < nr_slot && slot[i].req; ++i) continue;
+	if (i >= nr_slot) return 0;
+	s = slot + i;
+	s->req = req;
+	s->hdr.type = (req->cmd == READ)? VIRTIO_BLK_T_IN: VIRTIO_BLK_T_OUT;
+	s->hdr.ioprio = 0;
+	s->hdr.sector = req->sector;
+	s->hdr.sector_hi = 0;
+	s->status = 0xff;
+
+	first = i * DESC_PER_SLOT;
+	d = desc + first;
+	wr = (req->cmd == READ)? VRING_DESC_F_WRITE: 0;
+	d->addr = (unsigned long)&s->hdr;	/* kernel memory is identity mapped */
+	d->len = sizeof(s->hdr);
+	d->flags = VRING_DESC_F_NEXT;
+	if (req->nr_bh) {
+		for (i = 0; i < req->nr_bh; ++i) {
+			++d;
+			d->addr = (unsigned long)req->bh[i]->b_data;
+			d->len = BLOCK_SIZE;
+			d->flags = VRING_DESC_F_NEXT | wr;
+		}
+	} else {
+		++d;
+		d->addr = (unsigned long)req->buffer;
+		d->len = req->nr_sect * 512;
+		d->flags = VRING_DESC_F_NEXT | wr;
+	}
+	++d;
+	d->addr = (unsigned long)&s->status;
+	d->len = 1;
+	d->flags = VRING_DESC_F_WRITE;
+
+	avail->ring[avail->idx % queue_size] = first;
+	barrier();
+	avail->idx++;
+	return 1;
+}
+
+/*
+ * hand the queued requests to the device, as many as there are free
+ * slots. unlike hd and floppy, a request leaves CURRENT once submitted,
+ * so several are in flight. called with interrupts off.
+ */
+static void submit_requests(void) {
+	struct request *req;
+	int nr = 0;
+
+	while ((req = CURRENT)) {
+		if (MAJOR(req->dev) != MAJOR_NR)
+			panic(DEV_NAME ": request list destroyed");
+		if (req->nr_bh && !req->bh[0]->b_lock)
+			panic(DEV_NAME ": block not locked");
+		if (MINOR(req->dev) || req->sector + req->nr_sect > capacity) {
+			end_request(0);
+			continue;
+		}
+		if (!submit(req)) break;
+		CURRENT = (blk_dev[MAJOR_NR].elevator->next_request)(req);
+		if (CURRENT) start_request(CURRENT);
+		nr++;
+	}
+	if (nr) {
+		barrier();
+		outw_p(0, io_base + VIRTIO_QUEUE_NOTIFY);
+	}
+}
+
+void do_virtio_blk_request(void) {
+	if (!io_base) {
+		while (CURRENT) end_request(0);
+		return;
+	}
+	cli();
+	submit_requests();
+	sti();
+}
+
+/* called by virtio_blk_int, completes every request on the used ring */
+void virtio_blk_interrupt(void) {
+	struct vblk_slot *s;
+	struct request *req;
+
+	(void)inb_p(io_base + VIRTIO_ISR);		/* reading acknowledges */
+	while (last_used != used->idx) {
+		s = slot + used->ring[last_used % queue_size].id / DESC_PER_SLOT;
+		last_used++;
+		if (!(req = s->req)) continue;
+		s->req = NULL;
+		finish_request(req, s->status == 0);
+		put_request(req);
+	}
+	submit_requests();
+}
+
+/* find a legacy virtio-blk device (1af4:1001) on PCI bus 0 */
+static int vblk_probe(void) {
+	int dev;
+	unsigned long bar;
+
+	for (dev = 0; dev < 32; ++dev) {
+		if (pci_read(dev, 0, 0) != 0x10011af4) continue;
+		bar = pci_read(dev, 0, 0x10);	/* BAR0 */
+		if (!(bar & 1)) continue;
+		pci_write(dev, 0, 4, pci_read(dev, 0, 4) | 0x05);	/* I/O, bus master */
+		io_base = bar & 0xfffc;
+		vblk_irq = pci_read(dev, 0, 0x3c) & 0xff;
+		return 1;
+	}
+	return 0;
+}
+
+/* blocks of the disk, for read-ahead */
+static unsigned long vblk_nr_blk(int dev) {
+	return MINOR(dev)? 0: capacity >> 1;
+}
+
+void virtio_blk_init(void) {
+	unsigned long ring;
+	int i, j;
+
+	blk_dev[MAJOR_NR].request_func = DEV_REQUEST;
+	blk_dev[MAJOR_NR].nr_blk = &vblk_nr_blk;
+	if (!vblk_probe()) return;
+
+	outb_p(0, io_base + VIRTIO_STATUS);		/* reset */
+	outb_p(STATUS_ACK, io_base + VIRTIO_STATUS);
+	outb_p(STATUS_ACK | STATUS_DRIVER, io_base + VIRTIO_STATUS);
+	(void)inl_p(io_base + VIRTIO_FEATURES);
+	outl_p(0, io_base + VIRTIO_GUEST_FEATURES);	/* none needed */
+
+	outw_p(0, io_base + VIRTIO_QUEUE_SEL);
+	queue_size = inw_p(io_base + VIRTIO_QUEUE_SIZE);
+	if (!queue_size || queue_size > MAX_QUEUE_SIZE) {
+		printk("vd: bad queue size %d\n\r", queue_size);
+		outb_p(STATUS_FAILED, io_base + VIRTIO_STATUS);
+		io_base = 0;
+		return;
+	}
+	/* descriptors, then the avail ring, then the used ring on a new page */
+	desc = (struct vring_desc *)vring_area;
+	avail = (struct vring_avail *)(vring_area + queue_size * 16);
+	ring = queue_size * 16 + 6 + queue_size * 2;
+	used = (struct vring_used *)(vring_area + ((ring + 4095) & ~4095));
+	if ((nr_slot = queue_size / DESC_PER_SLOT) > NR_SLOT) nr_slot = NR_SLOT;
+	for (i = 0; i < nr_slot; ++i)
+		for (j = 0; j < DESC_PER_SLOT - 1; ++j)
+			desc[i * DESC_PER_SLOT + j].next = i * DESC_PER_SLOT + j + 1;
+	outl_p((unsigned long)vring_area >> 12, io_base + VIRTIO_QUEUE_PFN);
+
+	capacity = inl_p(io_base + VIRTIO_BLK_CAPACITY);
+	if (inl_p(io_base + VIRTIO_BLK_CAPACITY + 4))
+		capacity = 0xffffffff;
+
+	set_int_gate(0x20 + vblk_irq, &virtio_blk_int);
+	if (vblk_irq < 8) {
+		outb_p(inb_p(0x21) & ~(1 << vblk_irq), 0x21);
+	} else {
+		outb_p(inb_p(0x21) & 0xfb, 0x21);		/* master 8259A, IRQ2 allowed */
+		outb(inb_p(0xa1) & ~(1 << (vblk_irq - 8)), 0xa1);
+	}
+	outb_p(STATUS_ACK | STATUS_DRIVER | STATUS_DRIVER_OK, io_base + VIRTIO_STATUS);
+	printk("vd: virtio-blk at %04x, irq %d, %u sectors, %d in flight\n\r",
+		io_base, vblk_irq, capacity, nr_slot);
+}
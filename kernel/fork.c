@@ -10,6 +10,7 @@
 #include <asm/system.h>
 
 extern void write_verify(unsigned long addr);
+extern void set_task_page(unsigned long page);
 
 long new_pid = 0;
 
@@ -57,6 +58,7 @@ int copy_process(int nr, long ebp, long edi, long esi,
 
     p = (struct task_struct *)get_free_page();
     if (!p) return -EAGAIN;
+    set_task_page((unsigned long)p);
     task[nr] = p;
     *p = *current;
 
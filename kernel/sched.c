@@ -24,8 +24,11 @@ void show_task(int nr, struct task_struct *p) {
 
 void show_stat(void) {
     int i;
+    extern void calc_mem(void);     /* mm/mm.c */
+
     for (i = 0; i < NR_TASKS; ++i)
         if (task[i]) show_task(i, task[i]);
+    calc_mem();
 }
 
 #define LATCH (1193180 / HZ)
@@ -228,6 +231,9 @@ void do_floppy_timer(void) {
 void do_timer(long cpl) {
     extern int beepcount;
     extern void beepstop(void);
+    extern void ksm_timer(void);    /* mm/mm.c */
+    extern void hd_timer(void);     /* kernel/blk_dev/hd.c */
+    extern void floppy_watchdog(void);  /* kernel/blk_dev/floppy.c */
 
     if (beepcount)
         if (!--beepcount) beepstop();
@@ -248,12 +254,35 @@ void do_timer(long cpl) {
 
     if (cur_DOR & 0xf0)
         do_floppy_timer();
+    floppy_watchdog();
+    hd_timer();
+    ksm_timer();
     if ((--current->counter) > 0) return;
     current->counter = 0;
     if (!cpl) return;
     schedule();
 }
 
+/* 
+ * microseconds since boot, for timing shorter than a tick. the 8253 
+ * counts down from LATCH, a tick whose interrupt is still pending 
+ * has already been counted from LATCH again. wraps in about 71 minutes, 
+ * take differences only.
+ */
+unsigned long usec_clock(void) {
+    unsigned long flags, j, count;
+
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r" (flags));
+    j = jiffies;
+    outb_p(0x00, 0x43);             /* latch channel 0 */
+    count = inb_p(0x40);
+    count |= inb_p(0x40) << 8;
+    outb_p(0x0a, 0x20);             /* read the IRR of the 8259 */
+    if ((inb_p(0x20) & 1) && count > LATCH / 2) j++;
+    __asm__ __volatile__("pushl %0; popfl" : : "r" (flags));
+    return j * (1000000 / HZ) + (LATCH - count) * (1000000 / HZ) / LATCH;
+}
+
 int sys_alarm(long sec) {
     int original = current->alarm;
     if (original)
@@ -312,8 +341,8 @@ void sched_init(void) {
     __asm__("pushfl; andl $0xffffbffff, (%esp); popfl");    /* clear NT */
     ltr(0);
     lldt(0);
-    /* init 8253 */
-    outb_p(0x36, 0x43);
+    /* init 8253, mode 2 counts down once a tick, see usec_clock() */
+    outb_p(0x34, 0x43);
     outb_p(LATCH & 0xff, 0x40);
     outb_p(LATCH >> 8, 0x40);
     set_int_gate(0x20, &timer_interrupt);
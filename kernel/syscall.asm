@@ -30,14 +30,23 @@ sa_mask     equ 4
 sa_flags    equ 8
 sa_restorer equ 12
 
-nr_syscalls equ 72
+; syscalls past the original 72, the table is in include/mirix/sys.h
+; 72 -- sys_memstat (mm/mm.c)
+; 73 -- sys_memctl (mm/mm.c)
+; 74 -- sys_bdflush (kernel/blk_dev/rw_blk.c)
+; 75 -- sys_iostat (kernel/blk_dev/rw_blk.c)
+; 76 -- sys_dio (kernel/blk_dev/rw_blk.c)
+; 77 -- sys_aio (kernel/blk_dev/rw_blk.c)
+; 78 -- sys_ksmd (mm/mm.c)
+nr_syscalls equ 79
 
 global _system_call, _sys_fork, _sys_execve
-global _hd_int, _floppy_int
+global _hd_int, _hd2_int, _floppy_int, _virtio_blk_int
 global _device_not_available, _coprocessor_error, _timer_interrupt
 extern _schedule, _syscall_table
 extern _current, _task, _do_signal, _jiffies, _do_timer
 extern _find_empty_process, _copy_process, _do_execve
+extern _hd_interrupt, _virtio_blk_interrupt
 
 align 2
 bad_system_call:
@@ -148,14 +157,24 @@ _sys_execve:
     add esp, 4
     ret
 
+; IRQ 14 and IRQ 15, the channel nr is passed to hd_interrupt
 align 2
 _hd_int:
     push eax
+    xor eax, eax
+    jmp hd_common_int
+
+align 2
+_hd2_int:
+    push eax
+    mov eax, 1
+hd_common_int:
     push ecx
     push edx
     push ds
     push es
     push fs
+    push eax
     mov eax, 0x10
     mov ds, ax
     mov es, ax
@@ -164,14 +183,36 @@ _hd_int:
     mov al, 0x20    ; EOI
     out 0xa0, al
     db 0xeb, 0xeb
-    xor edx, edx
-    xchg edx, [_do_hd]
-    test edx, edx
-    jne normal_hd_int
-    mov eax, _unexpected_hd_int
-normal_hd_int:
     out 0x20, al
-    call edx
+    call _hd_interrupt      ; kernel/blk_dev/hd.c
+    add esp, 4
+    pop fs
+    pop es
+    pop ds
+    pop edx
+    pop ecx
+    pop eax
+    iret
+
+; the PCI interrupt line of virtio-blk, set up by virtio_blk_init
+align 2
+_virtio_blk_int:
+    push eax
+    push ecx
+    push edx
+    push ds
+    push es
+    push fs
+    mov eax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov eax, 0x17
+    mov fs, ax
+    mov al, 0x20    ; EOI
+    out 0xa0, al
+    db 0xeb, 0xeb
+    out 0x20, al
+    call _virtio_blk_interrupt  ; kernel/blk_dev/virtio_blk.c
     pop fs
     pop es
     pop ds
@@ -3,11 +3,18 @@
  * (C) 2021 Miris Lee
  */
 
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
 #include <asm/system.h>
+#include <asm/segment.h>
 #include <mirix/sched.h>
 #include <mirix/head.h>
 #include <mirix/kernel.h>
 
+extern void blk_read_page(unsigned long page, int dev, int nr[4]);	/* kernel/blk_dev/rw_blk.c */
+extern int do_exit(long code);		/* kernel/exit.c */
+
 /* flush the page cache */
 #define invalidate() \
 	__asm__("movl %%eax, %%cr3"::"a"(0))
@@ -26,17 +33,90 @@
 static long HIGH_MEM = 0;
 	
 #define copy_page(src,dest) \
-	__asm__(
-		"cld; rep; movsl"
-		::"S"(src), "D"(dest), "c"(1024)
+	__asm__( \
+		"cld; rep; movsl" \
+		::"S"(src), "D"(dest), "c"(1024) \
 		:"cx", "di", "si")
 
 /* byte map of page mapping */
 static unsigned char mem_map[PAGING_PAGE] = { 0, };
 
+/* pins taken by pin_user_page(), a pinned page is never shared by fork() */
+static unsigned char pin_count[PAGING_PAGE] = { 0, };
+
+/* what each page is used for */
+#define MEM_KERNEL	0		/* untagged get_free_page() */
+#define MEM_PGTABLE	1
+#define MEM_TASK		2		/* task structs and kernel stacks, fork.c */
+#define MEM_BUFFER	3
+#define MEM_ANON		4
+#define MEM_FILE		5
+#define MEM_ZPOOL		6		/* compressed swap pool */
+#define NR_MEM_USE	7
+
+static unsigned char mem_use[PAGING_PAGE] = { 0, };
+
+/* memory statistics, the layout is shared with user space by sys_memstat() */
+struct mem_stat {
+	long total;				/* pages between LOW_MEM and HIGH_MEM */
+	long free;
+	long use[NR_MEM_USE];	/* pages per MEM_xxx */
+	long shared;			/* pages with more than one reference (COW) */
+	long nr_alloc, nr_free;
+	long alloc_rate, free_rate;	/* pages per second */
+	long cow_faults, cow_copies;
+	long largest_free;		/* largest run of contiguous free pages */
+	long low_free, high_free;	/* reclaim watermarks */
+	long nr_reclaim;		/* clean file-backed pages unmapped */
+	long zram_limit;		/* max pool pages */
+	long zram_stored, zram_same;	/* pages swapped out, same-filled ones */
+	long zram_bytes;		/* compressed bytes in the pool */
+	long zram_out, zram_in, zram_reject;
+	long ksm_pages, ksm_interval;	/* pages per scan, ticks between scans */
+	long ksm_scanned, ksm_merged, ksm_rounds;
+};
+
+static struct mem_stat mem_stat = { 0, };
+
+static inline void set_page_use(unsigned long addr, int use) {
+	addr = MAP_NR(addr);
+	mem_stat.use[mem_use[addr]]--;
+	mem_stat.use[mem_use[addr] = use]++;
+}
+
+/* tag a page from get_free_page() as a task struct, for fork.c */
+void set_task_page(unsigned long page) {
+	set_page_use(page, MEM_TASK);
+}
+
+/* take one more reference on the page with index 'nr' */
+static inline void get_page_ref(unsigned long nr) {
+	if (mem_map[nr]++ == 1) mem_stat.shared++;
+}
+
+/* 
+ * page table occupancy, indexed by the page of the page table itself. 
+ * pt_count[] counts the non-empty entries (present pages and swap 
+ * entries), bit i of pt_map[] is set once entries i*32 ~ i*32+31 held 
+ * one, so the walkers can skip empty regions of a table.
+ */
+#define PT_GROUP		32
+static unsigned short pt_count[PAGING_PAGE] = { 0, };
+static unsigned long pt_map[PAGING_PAGE] = { 0, };
+
+/* entry 'nr' of the page table at 'table' becomes non-empty */
+static inline void pt_add(unsigned long table, unsigned long nr) {
+	if (table < LOW_MEM) return;
+	table = MAP_NR(table);
+	pt_count[table]++;
+	pt_map[table] |= 1UL << (nr / PT_GROUP);
+}
+
 /* get physical address of the last free page */
 unsigned long get_free_page(void) {
 	register unsigned long __res asm("ax");
+	unsigned long nr;
+	
 	__asm__(
 		"std; repne; scasb	\n\t"
 		"jne 1f					\n\t"
@@ -52,24 +132,291 @@ unsigned long get_free_page(void) {
 		: "=a"(__res)
 		: ""(0), "i"(LOW_MEM), "c"(PAGING_PAGE), "D"(mem_map+PAGING_PAGE-1)
 		: "di", "cx", "dx");
+	if (__res) {
+		nr = MAP_NR(__res);
+		mem_use[nr] = MEM_KERNEL;
+		mem_stat.use[MEM_KERNEL]++;
+		mem_stat.free--;
+		mem_stat.nr_alloc++;
+	}
 	return __res;
 }
 
+/* get an empty page table */
+static unsigned long get_pg_table(void) {
+	unsigned long tmp;
+	
+	if (!(tmp = get_free_page())) return 0;
+	set_page_use(tmp, MEM_PGTABLE);
+	pt_count[MAP_NR(tmp)] = 0;
+	pt_map[MAP_NR(tmp)] = 0;
+	return tmp;
+}
+
 /* free a page of memory at physical address 'addr' */
 void free_page(unsigned long addr) {
 	if (addr < LOW_MEM) return;
 	if (addr >= HIGH_MEM) panic("trying to free nonexisting page");
 	addr -= LOW_MEM;
 	addr >>= 12;			/* get the page index */
-	if (mem_map[addr]--) return;
-	mem_map[addr] = 0;
-	panic("trying to free free page");
+	if (!mem_map[addr]) panic("trying to free free page");
+	if (--mem_map[addr]) {
+		if (mem_map[addr] == 1) mem_stat.shared--;
+		return;
+	}
+	mem_stat.use[mem_use[addr]]--;
+	mem_stat.free++;
+	mem_stat.nr_free++;
+}
+
+/* give back 'n' pages taken out of a page table in one go */
+static void free_pages(unsigned long *pages, int n) {
+	unsigned long nr;
+	int freed = 0;
+	
+	while (n-- > 0) {
+		if ((nr = *pages++) < LOW_MEM) continue;
+		if (nr >= HIGH_MEM) panic("trying to free nonexisting page");
+		nr = MAP_NR(nr);
+		if (!mem_map[nr]) panic("trying to free free page");
+		if (--mem_map[nr]) {
+			if (mem_map[nr] == 1) mem_stat.shared--;
+			continue;
+		}
+		mem_stat.use[mem_use[nr]]--;
+		freed++;
+	}
+	mem_stat.free += freed;
+	mem_stat.nr_free += freed;
+}
+
+/* 
+ * compressed swap in memory for anonymous pages. a swapped out page 
+ * leaves SWP_ENTRY(nr) in its non-present page table entry, slot 'nr' 
+ * holds either the fill value of a same-filled page or the place of 
+ * the compressed data in the pool. pool pages are cut into 64-byte 
+ * chunks, one object uses a run of chunks within a single page.
+ */
+#define SWP_ENTRY(nr)		((nr) << 1)
+#define SWP_NR(entry)		((entry) >> 1)
+
+#define ZRAM_SLOTS		2048
+#define ZRAM_POOL_MAX		512
+#define ZRAM_CHUNK		64
+#define ZRAM_MAX_SIZE		3072		/* larger is not worth storing */
+
+static struct zram_slot {
+	unsigned long value;	/* fill value, or pool nr << 6 | chunk */
+	unsigned short size;	/* compressed bytes, 0 -- same-filled */
+	unsigned short count;	/* entries referring to it, 0 -- free */
+} zram_slot[ZRAM_SLOTS] = { { 0, 0, 0 }, };
+
+static struct zram_pool {
+	unsigned long page;
+	unsigned long map[2];	/* used chunks */
+} zram_pool[ZRAM_POOL_MAX] = { { 0, { 0, 0 } }, };
+
+static unsigned char zram_buf[ZRAM_MAX_SIZE];
+
+/* LZSS: 8 flags per control byte, a match is 12 bits offset, 4 bits length - 3 */
+#define LZ_HASH_SIZE		1024
+#define LZ_HASH(p)		((((p)[0] << 6) ^ ((p)[1] << 3) ^ (p)[2]) & (LZ_HASH_SIZE - 1))
+
+static unsigned short lz_hash[LZ_HASH_SIZE];
+
+/* compress a page into 'dest', 0 if it would take more than 'max' bytes */
+static int lz_compress(unsigned char *src, unsigned char *dest, int max) {
+	int i = 0, out = 0, ctrl = 0, bit = 8;
+	int h, cand, len, off;
+	
+	while (i < 4096) {
+		if (bit == 8) {
+			if (out + 17 > max) return 0;	/* 17 -- a control byte and 8 matches */
+			ctrl = out++;
+			dest[ctrl] = 0;
+			bit = 0;
+		}
+		len = 0;
+		if (i + 3 <= 4096) {
+			h = LZ_HASH(src + i);
+			cand = lz_hash[h];		/* may be stale, the bytes are compared */
+			lz_hash[h] = i;
+			if (cand < i && i - cand < 4096)
+				while (len < 18 && i + len < 4096 && src[cand + len] == src[i + len])
+					len++;
+		}
+		if (len >= 3) {
+			off = i - cand;
+			dest[ctrl] |= 1 << bit;
+			dest[out++] = off & 0xff;
+			dest[out++] = ((off >> 4) & 0xf0) | (len - 3);
+			i += len;
+		} else {
+			dest[out++] = src[i++];
+		}
+		bit++;
+	}
+	return out;
+}
+
+static void lz_decompress(unsigned char *src, unsigned char *dest) {
+	int i = 0, ctrl = 0, bit = 8;
+	int off, len;
+	
+	while (i < 4096) {
+		if (bit == 8) {
+			ctrl = *src++;
+			bit = 0;
+		}
+		if (ctrl & (1 << bit++)) {
+			off = src[0] | ((src[1] & 0xf0) << 4);
+			len = (src[1] & 0x0f) + 3;
+			src += 2;
+			for (; len-- > 0; ++i) dest[i] = dest[i - off];
+		} else {
+			dest[i++] = *src++;
+		}
+	}
+}
+
+/* find 'n' free chunks in a pool page, returns pool nr << 6 | chunk or -1 */
+static long zpool_alloc(int n) {
+	struct zram_pool *z;
+	int i, j, run;
+	
+	for (i = 0; i < ZRAM_POOL_MAX; ++i) {
+		z = zram_pool + i;
+		if (!z->page) continue;
+		for (j = run = 0; j < 4096 / ZRAM_CHUNK; ++j) {
+			if (z->map[j >> 5] & (1UL << (j & 31))) {
+				run = 0;
+				continue;
+			}
+			if (++run == n) goto found;
+		}
+	}
+	
+	/* no room, grow the pool */
+	if (mem_stat.use[MEM_ZPOOL] >= mem_stat.zram_limit) return -1;
+	for (i = 0; i < ZRAM_POOL_MAX; ++i)
+		if (!zram_pool[i].page) break;
+	if (i >= ZRAM_POOL_MAX) return -1;
+	z = zram_pool + i;
+	if (!(z->page = get_free_page())) return -1;
+	set_page_use(z->page, MEM_ZPOOL);
+	z->map[0] = z->map[1] = 0;
+	j = n - 1;
+	
+found:
+	for (j -= n - 1, run = 0; run < n; ++run)
+		z->map[(j + run) >> 5] |= 1UL << ((j + run) & 31);
+	return (i << 6) | j;
+}
+
+static void zpool_free(unsigned long value, int size) {
+	struct zram_pool *z = zram_pool + (value >> 6);
+	int j = value & 63, n = (size + ZRAM_CHUNK - 1) / ZRAM_CHUNK;
+	
+	for (; n-- > 0; ++j)
+		z->map[j >> 5] &= ~(1UL << (j & 31));
+	if (z->map[0] || z->map[1]) return;
+	free_page(z->page);
+	z->page = 0;
+}
+
+#define ZPOOL_ADDR(value) \
+	(zram_pool[(value) >> 6].page + ((value) & 63) * ZRAM_CHUNK)
+
+/* drop one reference to the slot of a swap entry */
+static void zram_free(unsigned long entry) {
+	struct zram_slot *z = zram_slot + SWP_NR(entry);
+	
+	if (SWP_NR(entry) >= ZRAM_SLOTS || !z->count) panic("zram_free: bad swap entry");
+	if (--z->count) return;
+	if (z->size) {
+		zpool_free(z->value, z->size);
+		mem_stat.zram_bytes -= z->size;
+	} else {
+		mem_stat.zram_same--;
+	}
+	mem_stat.zram_stored--;
+}
+
+/* compress the page of the present entry into a slot, 0 if it can't be done */
+static int zram_out(unsigned long *entry) {
+	static int hint = 1;
+	unsigned long page = *entry & 0xfffff000, *p = (unsigned long *)page;
+	struct zram_slot *z;
+	long value;
+	int i, size;
+	
+	for (i = 1; i < ZRAM_SLOTS; ++i, ++hint) {
+		if (hint >= ZRAM_SLOTS) hint = 1;	/* 0 would be an empty entry */
+		if (!zram_slot[hint].count) break;
+	}
+	if (i >= ZRAM_SLOTS) return 0;
+	z = zram_slot + hint;
+	
+	for (i = 1; i < 1024 && p[i] == p[0]; ++i) continue;
+	if (i == 1024) {
+		z->value = p[0];
+		z->size = 0;
+		mem_stat.zram_same++;
+	} else {
+		if (!(size = lz_compress((unsigned char *)page, zram_buf, ZRAM_MAX_SIZE))
+			|| (value = zpool_alloc((size + ZRAM_CHUNK - 1) / ZRAM_CHUNK)) < 0) {
+			mem_stat.zram_reject++;
+			return 0;
+		}
+		memcpy((void *)ZPOOL_ADDR(value), zram_buf, size);
+		z->value = value;
+		z->size = size;
+		mem_stat.zram_bytes += size;
+	}
+	z->count = 1;
+	*entry = SWP_ENTRY(hint);
+	free_page(page);
+	mem_stat.zram_stored++;
+	mem_stat.zram_out++;
+	return 1;
+}
+
+static void reclaim_pages(long want, int anon);
+
+/* 
+ * bring the page of swap entry '*entry' back into memory. short of a 
+ * page even after reclaim, the faulting task is killed, not the kernel.
+ */
+static void zram_in(unsigned long *entry) {
+	struct zram_slot *z = zram_slot + SWP_NR(*entry);
+	unsigned long page, *p;
+	int i;
+	
+	if (SWP_NR(*entry) >= ZRAM_SLOTS || !z->count) panic("zram_in: bad swap entry");
+	if (!(page = get_free_page())) {
+		reclaim_pages(mem_stat.high_free, 1);
+		if (!(page = get_free_page())) {
+			printk("out of memory, swap-in failed\n\r");
+			do_exit(SIGSEGV);
+		}
+	}
+	set_page_use(page, MEM_ANON);
+	if (z->size) {
+		lz_decompress((unsigned char *)ZPOOL_ADDR(z->value), (unsigned char *)page);
+	} else {
+		for (p = (unsigned long *)page, i = 0; i < 1024; ++i) p[i] = z->value;
+	}
+	zram_free(*entry);
+	*entry = page | 7;
+	mem_stat.zram_in++;
+	invalidate();
 }
 
 /* free a continuous block of page tables */
 int free_page_tables(unsigned long start, unsigned long size) {
-	unsigned long *pg_table;
-	unsigned long *dir, nr;
+	unsigned long *pg_table, *dir;
+	unsigned long table, map, pages[PT_GROUP];
+	int group, nr, n, left;
 	
 	if (start & 0x3fffff) panic("free_page_tables called with wrong alignment");
 	if (!start) panic("trying to free up swapper memory space");
@@ -77,28 +424,262 @@ int free_page_tables(unsigned long start, unsigned long size) {
 	dir = PG_DIR(start);
 	for (; size-- > 0; ++dir) {
 		if (!(*dir & 1)) continue;		/* P=0 */
-		pg_table = PG_TABLE(dir);
-		for (nr = 0; nr < 1024; ++nr) {
-			if (*pg_table & 1) free_page(*pg_table & 0xfffff000);	/* P=1 */
-			*pg_table = 0;
-			++pg_table;
+		table = *dir & 0xfffff000;
+		pg_table = (unsigned long *)table;
+		map = pt_map[MAP_NR(table)];
+		left = pt_count[MAP_NR(table)];
+		
+		/* only visit the groups that have ever held a present entry */
+		for (group = 0; map && left > 0; ++group, map >>= 1) {
+			if (!(map & 1)) continue;
+			n = 0;
+			for (nr = group * PT_GROUP; nr < (group + 1) * PT_GROUP; ++nr) {
+				if (!pg_table[nr]) continue;
+				if (pg_table[nr] & 1)		/* P=1 */
+					pages[n++] = pg_table[nr] & 0xfffff000;
+				else
+					zram_free(pg_table[nr]);
+				pg_table[nr] = 0;
+				left--;
+			}
+			free_pages(pages, n);
 		}
-		free_page(*dir & 0xfffff000);
+		free_page(table);
 		*dir = 0;
 	}
 	invalidate();
 	return 0;
 }
 
+/* 
+ * reclaim of clean file-backed pages. they are exact copies of the 
+ * executable, so they are unmapped and do_no_page() reads them back in. 
+ * with 'anon' set, unshared anonymous pages are compressed into zram too. 
+ * a clock hand walks the user page tables and gives recently accessed 
+ * pages a second chance. the first 64MB belongs to task 0 and is skipped.
+ */
+static unsigned long scan_dir = 16, scan_nr = 0;
+
+static void reclaim_pages(long want, int anon) {
+	unsigned long *pg_table, table, page;
+	int dirs;
+	
+	for (dirs = 2 * (1024 - 16); dirs > 0 && mem_stat.free < want; --dirs) {
+		table = pg_dir[scan_dir] & 0xfffff000;
+		if ((pg_dir[scan_dir] & 1) && table >= LOW_MEM) {
+			pg_table = (unsigned long *)table;
+			for (; scan_nr < 1024 && mem_stat.free < want; ++scan_nr) {
+				if (!(pt_map[MAP_NR(table)] & (1UL << (scan_nr / PT_GROUP)))) {
+					scan_nr |= PT_GROUP - 1;	/* skip the empty group */
+					continue;
+				}
+				page = pg_table[scan_nr];
+				if (!(page & 1)) continue;
+				if (page & 0x20) {		/* 0x20 -- A */
+					pg_table[scan_nr] &= ~0x20;
+					continue;
+				}
+				if ((page &= 0xfffff000) < LOW_MEM) continue;
+				if (mem_use[MAP_NR(page)] == MEM_FILE) {
+					if (pg_table[scan_nr] & 0x40) continue;		/* 0x40 -- D */
+					pg_table[scan_nr] = 0;
+					pt_count[MAP_NR(table)]--;
+					free_page(page);
+					mem_stat.nr_reclaim++;
+				} else if (anon && mem_use[MAP_NR(page)] == MEM_ANON
+					&& mem_map[MAP_NR(page)] == 1) {
+					zram_out(pg_table + scan_nr);
+				}
+			}
+			if (scan_nr < 1024) break;
+		}
+		scan_nr = 0;
+		if (++scan_dir >= 1024) scan_dir = 16;
+	}
+	invalidate();
+}
+
+/* 
+ * keep free memory above the low watermark. only called where no 
+ * page table entry is being held, as any clean file page may go.
+ */
+static inline void balance_pages(void) {
+	if (mem_stat.free >= mem_stat.low_free) return;
+	reclaim_pages(mem_stat.high_free, 0);
+	if (mem_stat.free < mem_stat.low_free)
+		reclaim_pages(mem_stat.high_free, 1);
+}
+
+/* 
+ * same-page merging. ksmd, woken by the timer, hashes unshared 
+ * anonymous pages, a page whose checksum held since its last visit is 
+ * looked up in a direct-mapped table of such pages, and if the contents 
+ * are the same it is replaced by the one in the table, write-protected. 
+ * a later write splits them again through do_wp_page().
+ */
+#define KSM_HASH		512
+
+static struct ksm_node {
+	unsigned long page;
+	unsigned long *entry;	/* where 'page' was seen mapped */
+	unsigned long sum;
+} ksm_table[KSM_HASH] = { { 0, NULL, 0 }, };
+
+static unsigned long ksm_sum[PAGING_PAGE] = { 0, };
+static unsigned long ksm_dir = 16, ksm_nr = 0, ksm_ticks = 0;
+
+static unsigned long page_sum(unsigned long *p) {
+	unsigned long sum = 0;
+	int i;
+	
+	for (i = 0; i < 1024; ++i) sum = (sum << 5) + (sum >> 27) + p[i];
+	return sum;
+}
+
+/* is the table entry still a mapping of its page */
+static inline int ksm_valid(struct ksm_node *node) {
+	if (!node->entry) return 0;
+	if (mem_use[MAP_NR((unsigned long)node->entry & 0xfffff000)] != MEM_PGTABLE) return 0;
+	if ((*node->entry & 0xfffff001) != (node->page | 1)) return 0;
+	return mem_use[MAP_NR(node->page)] == MEM_ANON;
+}
+
+static void ksm_page(unsigned long *entry) {
+	unsigned long page = *entry & 0xfffff000, sum;
+	struct ksm_node *node;
+	
+	mem_stat.ksm_scanned++;
+	sum = page_sum((unsigned long *)page);
+	if (sum != ksm_sum[MAP_NR(page)]) {		/* changed since the last visit */
+		ksm_sum[MAP_NR(page)] = sum;
+		return;
+	}
+	node = ksm_table + sum % KSM_HASH;
+	if (node->page != page && node->sum == sum && ksm_valid(node)
+		&& !memcmp((void *)node->page, (void *)page, 4096)) {
+		*node->entry &= ~2;
+		get_page_ref(MAP_NR(node->page));
+		*entry = node->page | (*entry & 0xffd);		/* keep the flags, read only */
+		free_page(page);
+		mem_stat.ksm_merged++;
+		return;
+	}
+	node->page = page;
+	node->entry = entry;
+	node->sum = sum;
+}
+
+/* visit up to 'n' unshared anonymous pages */
+static void ksm_scan(long n) {
+	unsigned long *pg_table, table, page;
+	int dirs;
+	
+	for (dirs = 1024 - 16; dirs > 0 && n > 0; --dirs) {
+		table = pg_dir[ksm_dir] & 0xfffff000;
+		if ((pg_dir[ksm_dir] & 1) && table >= LOW_MEM) {
+			pg_table = (unsigned long *)table;
+			for (; ksm_nr < 1024 && n > 0; ++ksm_nr) {
+				if (!(pt_map[MAP_NR(table)] & (1UL << (ksm_nr / PT_GROUP)))) {
+					ksm_nr |= PT_GROUP - 1;
+					continue;
+				}
+				page = pg_table[ksm_nr];
+				if (!(page & 1) || (page &= 0xfffff000) < LOW_MEM) continue;
+				if (mem_use[MAP_NR(page)] != MEM_ANON || mem_map[MAP_NR(page)] != 1) continue;
+				ksm_page(pg_table + ksm_nr);
+				n--;
+			}
+			if (ksm_nr < 1024) break;
+		}
+		ksm_nr = 0;
+		if (++ksm_dir >= 1024) {
+			ksm_dir = 16;
+			mem_stat.ksm_rounds++;
+		}
+	}
+	invalidate();
+}
+
+static struct task_struct *ksm_task = NULL, *ksm_wait = NULL;
+
+/* called by do_timer() on every tick, the scan itself is done by ksmd */
+void ksm_timer(void) {
+	if (!mem_stat.ksm_pages || ++ksm_ticks < mem_stat.ksm_interval) return;
+	ksm_ticks = 0;
+	wake_up(&ksm_wait);
+}
+
+/* 
+ * the merging task, started by init() and never returns. it scans in 
+ * process context, where every other task is in user mode or asleep at 
+ * a point that holds no page table entry. kernel writes to the pages it 
+ * write-protects fault too, CR0.WP is set in boot/head.asm.
+ */
+int sys_ksmd(void) {
+	if (!suser()) return -EPERM;
+	if (ksm_task) return -EBUSY;
+	ksm_task = current;
+	while (1) {
+		cli();
+		sleep_on(&ksm_wait);
+		sti();
+		if (mem_stat.ksm_pages) ksm_scan(mem_stat.ksm_pages);
+	}
+}
+
+/* 
+ * share a group of entries read-only, return the number of non-empty 
+ * ones. a pinned page is copied instead, a device or an aio ring may be 
+ * using it and copy-on-write would move the parent off it. '*oom' is set 
+ * when there is no page for the copy, the entries so far are counted.
+ */
+static int copy_pte_group(unsigned long *src_pg_table, unsigned long *dest_pg_table, 
+	int *oom) {
+	unsigned long this_page, new;
+	int nr, n = 0;
+	
+	for (nr = 0; nr < PT_GROUP; ++nr, ++src_pg_table, ++dest_pg_table) {
+		this_page = *src_pg_table;
+		if (!this_page) continue;
+		if (!(this_page & 1)) {		/* swap entry, share the slot */
+			zram_slot[SWP_NR(this_page)].count++;
+			*dest_pg_table = this_page;
+			n++;
+			continue;
+		}
+		if (this_page > LOW_MEM && pin_count[MAP_NR(this_page)]) {
+			if (!(new = get_free_page())) {
+				*oom = 1;
+				return n;
+			}
+			set_page_use(new, MEM_ANON);
+			copy_page(this_page & 0xfffff000, new);
+			*dest_pg_table = new | 7;
+			n++;
+			continue;
+		}
+		this_page &= ~2;	/* reset R/W, read only */
+		*dest_pg_table = this_page;
+		n++;
+		
+		if (this_page > LOW_MEM) {
+			*src_pg_table = this_page;
+			get_page_ref(MAP_NR(this_page));
+		}
+	}
+	return n;
+}
+
 /* copy a range of linear addresses by copying pages */
 int copy_page_tables(unsigned long src, unsigned long dest, long size) {
 	unsigned long *src_pg_table, *dest_pg_table;
-	unsigned long this_page;
 	unsigned long *src_dir, *dest_dir;
-	unsigned long nr;
+	unsigned long src_table, dest_table, map;
+	int group, n, left, oom = 0;
 	
 	if ((src & 0x3fffff) || (dest & 0x3fffff)) 
 		panic("copy_page_tables called with wrong alignment");
+	balance_pages();
 	src_dir = PG_DIR(src);
 	dest_dir = PG_DIR(dest);
 	size = ((unsigned)(size + 0x3fffff)) >> 22;
@@ -106,21 +687,31 @@ int copy_page_tables(unsigned long src, unsigned long dest, long size) {
 	for (; size-- > 0; ++src_dir, ++dest_dir) {
 		if (*dest_dir & 1) panic("copy_page_tables: already exist");	/* P=1 */
 		if (!(*src_dir & 1)) continue;	/* P=0 */
-		src_pg_table = PG_TABLE(src_dir);
-		if (!(dest_pg_table = (unsigned long *)get_free_page())) return -1;	/* out of memory */
-		*dest_dir = ((unsigned long)dest_pg_table) | 7;	/* 7 -- usr, R/W, Present */
-		nr = (src == 0)? 0xa0: 1024;
-		for (; nr-- > 0; ++src_pg_table; ++dest_pg_table) {
-			this_page = *src_pg_table;
-			if (!(this_page & 1)) continue;
-			this_page &= ~2;	/* reset R/W, read only */
-			*dest_pg_table = this_table;
-			
-			if (this_page > LOW_MEM) {
-				*src_pg_table = this_page;
-				this_page -= LOW_MEM;
-				this_page >>= 12;
-				mem_map[this_page]++;
+		src_table = *src_dir & 0xfffff000;
+		if (!(dest_table = get_pg_table())) return -1;	/* out of memory */
+		*dest_dir = dest_table | 7;	/* 7 -- usr, R/W, Present */
+		
+		if (src_table < LOW_MEM) {
+			/* kernel page table of task 0, only the first 0xa0 entries */
+			map = (1UL << (0xa0 / PT_GROUP)) - 1;
+			left = 0xa0;
+		} else {
+			map = pt_map[MAP_NR(src_table)];
+			left = pt_count[MAP_NR(src_table)];
+		}
+		for (group = 0; map && left > 0; ++group, map >>= 1) {
+			if (!(map & 1)) continue;
+			src_pg_table = (unsigned long *)src_table + group * PT_GROUP;
+			dest_pg_table = (unsigned long *)dest_table + group * PT_GROUP;
+			n = copy_pte_group(src_pg_table, dest_pg_table, &oom);
+			if (n) {
+				pt_count[MAP_NR(dest_table)] += n;
+				pt_map[MAP_NR(dest_table)] |= 1UL << group;
+				left -= n;
+			}
+			if (oom) {
+				invalidate();
+				return -1;
 			}
 		}
 	}
@@ -130,7 +721,7 @@ int copy_page_tables(unsigned long src, unsigned long dest, long size) {
 
 /* put a page in memory at address 'addr' */
 unsigned long put_page(unsigned long pg, unsigned long addr) {
-	unsigned long tmp, *pg_table;
+	unsigned long tmp, nr, *pg_table;
 	
 	if (pg < LOW_MEM || pg >= HIGH_MEM) 
 		printk("Trying to put page %p at %p\n", pg, addr);
@@ -141,11 +732,14 @@ unsigned long put_page(unsigned long pg, unsigned long addr) {
 	if (*pg_table & 1) {
 		pg_table = PG_TABLE(pg_table);
 	} else {
-		if (!(tmp = get_free_page())) return 0;
+		if (!(tmp = get_pg_table())) return 0;
 		*pg_table = tmp | 7;
 		pg_table = (unsigned long *)tmp;
 	}
-	pg_table[(addr >> 12) & 0x3ff] = pg | 7;
+	nr = (addr >> 12) & 0x3ff;
+	if (!pg_table[nr]) pt_add((unsigned long)pg_table, nr);
+	pg_table[nr] = pg | 7;
+	if (mem_use[MAP_NR(pg)] == MEM_KERNEL) set_page_use(pg, MEM_ANON);
 	return pg;
 }
 
@@ -159,7 +753,9 @@ void un_wp_page(unsigned long *entry) {
 		return;
 	}
 	if (!(new = get_free_page())) panic("out of memory");
-	if (old >= LOW_MEM) mem_map[MAP_NR(old)]--;
+	set_page_use(new, MEM_ANON);
+	mem_stat.cow_copies++;
+	if (old >= LOW_MEM && --mem_map[MAP_NR(old)] == 1) mem_stat.shared--;
 	*entry = new | 7;
 	invalidate();
 	copy_page(old, new);
@@ -167,8 +763,13 @@ void un_wp_page(unsigned long *entry) {
 
 /* copy a shared page when writing */
 void do_wp_page(unsigned long err_code, unsigned long addr) {
-	un_wp_page((unsigned long *)
-		(((addr >> 10) & 0xffc) + PG_TABLE(PG_DIR(addr))));
+	unsigned long *entry;
+	
+	mem_stat.cow_faults++;
+	balance_pages();
+	entry = (unsigned long *)(((addr >> 10) & 0xffc) + PG_TABLE(PG_DIR(addr)));
+	if (!(*entry & 1)) return;		/* swapped out, the retry faults it in */
+	un_wp_page(entry);
 }
 
 void write_verify(unsigned long addr) {
@@ -214,7 +815,7 @@ static int try_to_share(unsigned long addr, struct task_struct *p) {
 	
 	dest = *(unsigned long *)dest_pg;
 	if (!(dest & 1)) {
-		if (dest = get_free_page()) {
+		if (dest = get_pg_table()) {
 			*(unsigned long *)dest_pg = dest | 7;
 		} else {
 			panic("out of memory");
@@ -228,10 +829,11 @@ static int try_to_share(unsigned long addr, struct task_struct *p) {
 	/* share and write_protect */
 	*(unsigned long *)src_pg &= ~2;
 	*(unsigned long *)dest_pg = *(unsigned long *)src_pg;
+	pt_add(dest, (addr >> 12) & 0x3ff);
 	invalidate();
 	phys_addr -= LOW_MEM;
 	phys_addr >>= 12;
-	mem_map[phys_addr]++;
+	get_page_ref(phys_addr);
 	return 1;
 }
 
@@ -253,55 +855,178 @@ static int share_page(unsigned long addr) {
 /* process the no-page-exception */
 void do_no_page(unsigned long err_code, unsigned long addr) {
 	int nr[4];
-	unsigned long tmp, page;
+	unsigned long tmp, page, *pg_table;
 	int block, i;
 	
+	balance_pages();
 	addr &= 0xfffff000;
+	if ((tmp = *PG_DIR(addr)) & 1) {
+		pg_table = (unsigned long *)(tmp & 0xfffff000) + ((addr >> 12) & 0x3ff);
+		if (*pg_table) {		/* non-present, non-empty: a swap entry */
+			zram_in(pg_table);
+			return;
+		}
+	}
 	tmp = addr - current->start_code;	/* offset in current task space */
 	if (!current->executable || tmp >= current->end_data) {
 		get_empty_page(addr);
 		return;
 	}
 	if (share_page(tmp)) return;
-	if (!(page = get_free_page())) panic("out of memory");
+	if (!(page = get_free_page())) {
+		reclaim_pages(mem_stat.high_free, 1);
+		if (!(page = get_free_page())) panic("out of memory");
+	}
 	
 	block = tmp / BLOCK_SIZE + 1; /* 1 for header */
 	for (i = 0; i < 4; ++block, ++i)
 		nr[i] = bmap(current->executable, block);
-	bread_page(page, current->executable->i_dev, nr);
+	blk_read_page(page, current->executable->i_dev, nr);
 	
 	i = tmp + 4096 - current->end_data;
 	tmp = page + 4096;
 	while (i-- > 0) *(char *)(--tmp) = 0;
-	if (put_page(page, addr)) return;
+	if (put_page(page, addr)) {
+		set_page_use(page, MEM_FILE);
+		return;
+	}
 	free_page(page);
 	panic("out of memory");
 }
 
+/* 
+ * pin the page at linear address 'addr' for a device to transfer to 
+ * ('write') or from, returns its physical address or 0. the page is 
+ * faulted in and unshared first, the extra reference keeps it from 
+ * being freed or swapped out, and fork() copies it rather than share 
+ * it. unpin_user_page() gives it back.
+ */
+unsigned long pin_user_page(unsigned long addr, int write) {
+	unsigned long *entry, page, table;
+	
+	addr &= 0xfffff000;
+	table = *PG_DIR(addr);
+	if (!(table & 1) || !((PG_TABLE(PG_DIR(addr)))[(addr >> 12) & 0x3ff] & 1))
+		do_no_page(0, addr);
+	if (!((table = *PG_DIR(addr)) & 1)) return 0;
+	entry = (unsigned long *)(table & 0xfffff000) + ((addr >> 12) & 0x3ff);
+	if (!(*entry & 1)) return 0;
+	if (write) {
+		if (!(*entry & 2)) un_wp_page(entry);
+		*entry |= 0x40;		/* 0x40 -- D, the device does not set it */
+	}
+	page = *entry & 0xfffff000;
+	if (page < LOW_MEM || page >= HIGH_MEM) return 0;
+	get_page_ref(MAP_NR(page));
+	pin_count[MAP_NR(page)]++;
+	return page;
+}
+
+void unpin_user_page(unsigned long page) {
+	if (page >= LOW_MEM && page < HIGH_MEM && pin_count[MAP_NR(page)])
+		pin_count[MAP_NR(page)]--;
+	free_page(page);
+}
+
 void mem_init(long start_mem, long end_mem) {
 	int i;
 	
 	HIGH_MEM = end_mem;
-	for (i = 0; i < PAGING_PAGE; ++i) mem_map[i] = USED;
+	for (i = 0; i < PAGING_PAGE; ++i) mem_map[i] = USED_FLAG;
 	i = MAP_NR(start_mem);	/* start page */
+	mem_stat.use[MEM_BUFFER] = i;	/* buffer memory below main memory */
+	mem_stat.total = MAP_NR(end_mem);
 	end_mem -= start_mem;
 	end_mem >>= 12;	/* page nr */
+	mem_stat.free = end_mem;
+	mem_stat.low_free = end_mem / 64 + 4;
+	mem_stat.high_free = end_mem / 32 + 8;
+	mem_stat.zram_limit = end_mem / 4;
+	if (mem_stat.zram_limit > ZRAM_POOL_MAX) mem_stat.zram_limit = ZRAM_POOL_MAX;
+	mem_stat.ksm_pages = 16;
+	mem_stat.ksm_interval = HZ / 10;
 	while (end_mem-- > 0) mem_map[i++] = 0;
 }
 
-void calc_mem(void) {
-	int i, j, k, free = 0;
-	long *pg_table;
-	
-	for (i = 0; i < PAGING_PAGE; ++i) 
-		if (!mem_map[i]) free++;
-	printk("%d pages free (of %d)\n\r", free, PAGING_PAGE);
-	
-	for (i = 2; i < 1024; ++i) {
-		if (pg_dir[i] & 1) {
-			pg_table = (long *)(0xfffff000 & pg_dir[i]);
-			for (j = k = 0; j < 1024; ++j) if (pg_table[j] & 1) k++;
-			printk("pg_dir[%d] uses %d pages\n", i, k);
+/* fill in 's' from the running counters */
+static void get_mem_stat(struct mem_stat *s) {
+	static long last_jiffies = 0, last_alloc = 0, last_free = 0;
+	long i, run;
+	
+	/* rates are averaged over at least one second since the last report */
+	if ((i = jiffies - last_jiffies) >= HZ) {
+		mem_stat.alloc_rate = (mem_stat.nr_alloc - last_alloc) * HZ / i;
+		mem_stat.free_rate = (mem_stat.nr_free - last_free) * HZ / i;
+		last_jiffies = jiffies;
+		last_alloc = mem_stat.nr_alloc;
+		last_free = mem_stat.nr_free;
+	}
+	
+	/* the byte map is small, the page tables are not touched */
+	mem_stat.largest_free = 0;
+	for (i = run = 0; i < mem_stat.total; ++i) {
+		if (mem_map[i]) {
+			run = 0;
+			continue;
 		}
+		if (++run > mem_stat.largest_free) mem_stat.largest_free = run;
+	}
+	*s = mem_stat;
+}
+
+int sys_memstat(struct mem_stat *buf) {
+	struct mem_stat s;
+	int i;
+	
+	get_mem_stat(&s);
+	verify_area(buf, sizeof(struct mem_stat));
+	for (i = 0; i < sizeof(struct mem_stat) / 4; ++i)
+		put_fs_long(((unsigned long *)&s)[i], i + (unsigned long *)buf);
+	return 0;
+}
+
+/* memory tunables */
+#define MEMCTL_ZRAM_LIMIT	0
+#define MEMCTL_KSM_PAGES	1		/* 0 -- stop merging */
+#define MEMCTL_KSM_INTERVAL	2
+
+int sys_memctl(int cmd, long val) {
+	if (!suser()) return -EPERM;
+	switch (cmd) {
+	case MEMCTL_ZRAM_LIMIT:
+		if (val < 0 || val > ZRAM_POOL_MAX) return -EINVAL;
+		mem_stat.zram_limit = val;
+		return 0;
+	case MEMCTL_KSM_PAGES:
+		if (val < 0 || val > 1024) return -EINVAL;
+		mem_stat.ksm_pages = val;
+		return 0;
+	case MEMCTL_KSM_INTERVAL:
+		if (val < 1) return -EINVAL;
+		mem_stat.ksm_interval = val;
+		return 0;
 	}
-}
\ No newline at end of file
+	return -EINVAL;
+}
+
+void calc_mem(void) {
+	struct mem_stat s;
+	
+	get_mem_stat(&s);
+	printk("%d pages free (of %d), largest free block %d pages\n\r", 
+		s.free, s.total, s.largest_free);
+	printk("pgtable %d, task %d, buffer %d, anon %d, file %d, kernel %d, cow-shared %d\n\r",
+		s.use[MEM_PGTABLE], s.use[MEM_TASK], s.use[MEM_BUFFER], 
+		s.use[MEM_ANON], s.use[MEM_FILE], s.use[MEM_KERNEL], s.shared);
+	printk("alloc %d (%d/s), free %d (%d/s), cow faults %d (%d copied)\n\r",
+		s.nr_alloc, s.alloc_rate, s.nr_free, s.free_rate, 
+		s.cow_faults, s.cow_copies);
+	printk("watermarks %d/%d, %d file pages reclaimed\n\r",
+		s.low_free, s.high_free, s.nr_reclaim);
+	printk("zram %d pages (%d same-filled) in %d bytes, pool %d (of %d) pages\n\r",
+		s.zram_stored, s.zram_same, s.zram_bytes, s.use[MEM_ZPOOL], s.zram_limit);
+	printk("zram out %d, in %d, rejected %d\n\r", 
+		s.zram_out, s.zram_in, s.zram_reject);
+	printk("ksm %d pages every %d ticks, %d scanned, %d merged, %d rounds\n\r",
+		s.ksm_pages, s.ksm_interval, s.ksm_scanned, s.ksm_merged, s.ksm_rounds);
+}